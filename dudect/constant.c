@@ -73,7 +73,8 @@ bool measure(int64_t *before_ticks,
              int mode)
 {
     assert(mode == DUT(insert_head) || mode == DUT(insert_tail) ||
-           mode == DUT(remove_head) || mode == DUT(remove_tail));
+           mode == DUT(remove_head) || mode == DUT(remove_tail) ||
+           mode == DUT(delete_mid));
 
     switch (mode) {
     case DUT(insert_head):
@@ -146,6 +147,22 @@ bool measure(int64_t *before_ticks,
                 return false;
         }
         break;
+    case DUT(delete_mid):
+        for (size_t i = 0; i < N_MEASURES; i++) {
+            dut_new();
+            dut_insert_head(
+                get_random_string(),
+                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
+            int before_size = q_size(l);
+            before_ticks[i] = cpucycles();
+            bool ok = q_delete_mid(l);
+            after_ticks[i] = cpucycles();
+            int after_size = q_size(l);
+            dut_free();
+            if (!ok || before_size != after_size + 1)
+                return false;
+        }
+        break;
     default:
         for (size_t i = 0; i < N_MEASURES; i++) {
             dut_new();
@@ -1,7 +1,10 @@
 /* Test support code */
 
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,45 +21,176 @@
 /* Value at start of every allocated block */
 #define MAGICHEADER 0xdeadbeef
 
+/* Value at start of every block from test_aligned_alloc() */
+#define MAGICALIGNED 0xdeadbee5
+
 /* Value when deallocate block */
 #define MAGICFREE 0xffffffff
 
+/* Value when deallocate block without filling its payload */
+#define MAGICFREERAW 0xfffffffe
+
 /* Value at end of every block */
 #define MAGICFOOTER 0xbeefdead
 
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
+/* Value at start of every slab owned by an arena */
+#define MAGICSLAB 0xcafef00d
+
+/* Arena blocks are rounded up to this granularity */
+#define ARENA_ALIGN 16
+
+/* Largest block served from the shared slabs. Bigger requests get a slab of
+ * their own, which is returned to the system as soon as the block is freed.
+ */
+#define ARENA_MAX_BLOCK 512
+#define ARENA_CLASSES (ARENA_MAX_BLOCK / ARENA_ALIGN + 1)
+
+/* Slabs start small and double up to this size */
+#define ARENA_MIN_SLAB 4096
+#define ARENA_MAX_SLAB (1 << 20)
+
+/* Smallest capacity of each shard of the table of allocated blocks */
+#define TRACK_MIN 64
+
+/* Number of independently locked shards of that table, a power of 2 */
+#define TRACK_SHARDS 16
+
+/* Blocks of test_malloc() up to this footprint come from size-class pools
+ * carved out of chunks, larger ones straight from the system allocator.
+ */
+#define POOL_ALIGN 16
+#define POOL_MAX_BLOCK 512
+#define POOL_CLASSES (POOL_MAX_BLOCK / POOL_ALIGN + 1)
+#define POOL_CHUNK (64 * 1024)
+
+/* Number of freed pool blocks held back before they may be reused */
+#define QUARANTINE_SIZE 1024
+
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
+/* Header of a block allocated by test_malloc(). Every such block is recorded
+ * in the table of allocated blocks, see track_find().
+ * A block from test_aligned_alloc() is marked with MAGICALIGNED instead, and
+ * the word right before its header holds its alignment, which is also the
+ * distance from the start of its system allocation to the payload.
  */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
     unsigned char payload[0];
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Slab of memory owned by an arena, kept in a doubly-linked list */
+typedef struct __slab {
+    struct __slab *next, *prev;
+    test_arena_t *arena;
+    size_t size; /* Capacity of data area */
+    size_t used; /* Bytes handed out so far */
+    size_t magic;
+    unsigned char data[0];
+} slab_t;
+
+/* Header of a block served by an arena. The magic value sits right before the
+ * payload, at the same place as in block_element_t, and the payload is
+ * followed by a footer like any other block.
+ */
+typedef struct __arena_block {
+    slab_t *slab;
+    size_t payload_size;
+    size_t magic_header;
+    unsigned char payload[0];
+} arena_block_t;
+
+struct __test_arena {
+    slab_t *slabs;            /* Bump allocation happens in the first slab */
+    size_t next_slab;         /* Size of the next shared slab */
+    size_t live;              /* Blocks handed out and not freed yet */
+    void *free[ARENA_CLASSES]; /* Recycled blocks, linked through payload */
+    int refs;                  /* Owners yet to call test_arena_destroy() */
+};
+
+/* Chunk of memory backing the pools, never returned to the system */
+typedef struct __pool_chunk {
+    struct __pool_chunk *next;
+    size_t used; /* Bytes handed out so far */
+    unsigned char data[0];
+} pool_chunk_t;
+
+/* Allocation state of one thread, which it updates without locking. A pool
+ * block freed by another thread simply joins the cache of that thread.
+ */
+typedef struct __thread_cache {
+    struct __thread_cache *next, *prev; /* In the list of live threads */
+    bool registered;                    /* Retired when the thread exits */
+    _Atomic size_t allocated; /* Blocks allocated minus blocks freed here */
+    pool_chunk_t *chunk;      /* Bump allocation happens here */
+    void *free[POOL_CLASSES]; /* Reusable blocks, by footprint */
+    size_t quarantine_next;
+    /* Freed pool blocks, and large blocks freed poisoned, stay in this FIFO
+     * for a while, so that a late write through a dangling pointer into a
+     * poisoned one is caught when it leaves, and a double free still finds
+     * MAGICFREE or MAGICFREERAW in the header.
+     */
+    block_element_t *quarantine[QUARANTINE_SIZE];
+} thread_cache_t;
+
+static _Thread_local thread_cache_t thread_cache;
+
+/* State shared by all threads, guarded by cache_lock: the live threads, the
+ * count of blocks left by the ones that exited, every chunk, and the free
+ * lists of pool blocks left behind, which other threads take over a whole
+ * list at a time.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_cache_t *cache_threads = NULL;
+static size_t retired_count = 0;
+static pool_chunk_t *pool_chunks = NULL;
+static void *_Atomic pool_depot[POOL_CLASSES];
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+/* Open-addressing table of the blocks allocated by test_malloc(), keyed on
+ * their address with linear probing and kept at most half full, so that
+ * checking a block in cautious mode takes O(1) expected time. It is split in
+ * shards with a lock each, picked by address, so that threads rarely contend.
+ */
+typedef struct {
+    atomic_flag lock; /* Held for a few probes at most, so spun on */
+    block_element_t **slot;
+    size_t mask; /* Capacity minus one, 0 while @slot is NULL */
+    size_t count;
+} __attribute__((aligned(64))) track_shard_t;
+
+static track_shard_t track[TRACK_SHARDS] = {
+    [0 ... TRACK_SHARDS - 1] = {.lock = ATOMIC_FLAG_INIT},
+};
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Fill one payload out of this many with FILLCHAR, none if not positive */
+int poison_rate = 1;
+static _Thread_local unsigned int poison_tick = 0;
+
+/* Modes are only switched while no other thread uses the harness */
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+static _Atomic bool error_occurred = false;
 
 static int time_limit = 1;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+/* Data for managing exceptions, which every thread sets up for itself. The
+ * alarm of the time limit is shared by the process though, so only one
+ * thread at a time should limit its time.
+ */
+static _Thread_local char *error_message = "";
+static _Thread_local jmp_buf env;
+static _Thread_local volatile sig_atomic_t jmp_ready = false;
+static _Thread_local bool time_limited = false;
 
 /* Internal functions */
 
@@ -67,10 +201,271 @@ static bool fail_allocation()
     return (weight < 0.01 * fail_probability);
 }
 
-/* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+/* Should this payload be filled with FILLCHAR? */
+static inline bool poison_payload()
+{
+    if (poison_rate <= 1)
+        return poison_rate == 1;
+    if (++poison_tick < (unsigned int) poison_rate)
+        return false;
+    poison_tick = 0;
+    return true;
+}
+
+static inline size_t track_hash(block_element_t *b)
+{
+    /* Fibonacci hashing of the address, whose low bits are always zero */
+    return ((size_t) b >> 4) * 0x9e3779b97f4a7c15ULL;
+}
+
+/* The top bits of the hash pick the shard, the middle ones the slot */
+static inline track_shard_t *track_shard(block_element_t *b)
+{
+    return &track[track_hash(b) >> 60 & (TRACK_SHARDS - 1)];
+}
+
+static inline size_t track_home(track_shard_t *t, block_element_t *b)
+{
+    return track_hash(b) >> 32 & t->mask;
+}
+
+static inline void track_lock(track_shard_t *t)
+{
+    while (atomic_flag_test_and_set_explicit(&t->lock, memory_order_acquire))
+        sched_yield();
+}
+
+static inline void track_unlock(track_shard_t *t)
+{
+    atomic_flag_clear_explicit(&t->lock, memory_order_release);
+}
+
+/* Return the slot of shard t holding b, or the empty slot where it would go */
+static size_t track_find(track_shard_t *t, block_element_t *b)
+{
+    size_t i = track_home(t, b);
+    while (t->slot[i] && t->slot[i] != b)
+        i = (i + 1) & t->mask;
+    return i;
+}
+
+/* Record a newly allocated block, doubling its shard when half full */
+static bool track_add(block_element_t *b)
+{
+    track_shard_t *t = track_shard(b);
+    track_lock(t);
+    if (2 * (t->count + 1) > t->mask + 1) {
+        size_t cap = t->slot ? 2 * (t->mask + 1) : TRACK_MIN;
+        block_element_t **old = t->slot;
+        size_t old_cap = t->slot ? t->mask + 1 : 0;
+        t->slot = calloc(cap, sizeof(block_element_t *));
+        if (!t->slot) {
+            t->slot = old;
+            track_unlock(t);
+            return false;
+        }
+        t->mask = cap - 1;
+        for (size_t i = 0; i < old_cap; i++)
+            if (old[i])
+                t->slot[track_find(t, old[i])] = old[i];
+        free(old);
+    }
+    t->slot[track_find(t, b)] = b;
+    t->count++;
+    track_unlock(t);
+    return true;
+}
+
+/* Forget a block, shifting back the entries after it that would otherwise
+ * become unreachable. Return whether it was there.
+ */
+static bool track_del(block_element_t *b)
+{
+    track_shard_t *t = track_shard(b);
+    track_lock(t);
+    size_t i = t->slot ? track_find(t, b) : 0;
+    if (!t->slot || !t->slot[i]) {
+        track_unlock(t);
+        return false;
+    }
+    for (size_t j = (i + 1) & t->mask; t->slot[j]; j = (j + 1) & t->mask) {
+        size_t home = track_home(t, t->slot[j]);
+        /* The entry at j may fill the hole unless it hashes within (i, j] */
+        if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+            t->slot[i] = t->slot[j];
+            i = j;
+        }
+    }
+    t->slot[i] = NULL;
+    t->count--;
+    track_unlock(t);
+    return true;
+}
+
+static bool track_has(block_element_t *b)
+{
+    track_shard_t *t = track_shard(b);
+    track_lock(t);
+    bool found = t->slot && t->slot[track_find(t, b)];
+    track_unlock(t);
+    return found;
+}
+
+/* Given pointer to block, find its footer */
+static size_t *find_footer(block_element_t *b)
+{
+    // cppcheck-suppress nullPointerRedundantCheck
+    size_t *p =
+        (size_t *) ((size_t) b + b->payload_size + sizeof(block_element_t));
+    return p;
+}
+
+/* Footprint of a test_malloc() block, rounded up to the pool granularity */
+static size_t pool_block_size(size_t size)
+{
+    size_t total = sizeof(block_element_t) + size + sizeof(size_t);
+    return (total + POOL_ALIGN - 1) & ~(size_t) (POOL_ALIGN - 1);
+}
+
+/* Make a quarantined block available again, once it is certain that nothing
+ * has written to it since it was freed. A large block goes back to the system.
+ */
+static void pool_release(block_element_t *b)
+{
+    size_t magic = b->magic_header;
+    bool large = pool_block_size(b->payload_size) > POOL_MAX_BLOCK;
+    bool intact = (magic == MAGICFREE || (magic == MAGICFREERAW && !large)) &&
+                  *find_footer(b) == magic;
+    /* Every byte equals FILLCHAR iff the first does and each equals the next */
+    if (intact && magic == MAGICFREE && b->payload_size)
+        intact = b->payload[0] == FILLCHAR &&
+                 !memcmp(b->payload, b->payload + 1, b->payload_size - 1);
+    if (!intact) {
+        /* Leave the block out of the pool, its contents cannot be trusted */
+        report_event(MSG_ERROR,
+                     "Block with address %p was modified after being freed",
+                     (void *) &b->payload);
+        error_occurred = true;
+        if (large)
+            free(b);
+        return;
+    }
+    if (large) {
+        free(b);
+        return;
+    }
+
+    size_t bsize = pool_block_size(b->payload_size);
+    *(void **) b->payload = thread_cache.free[bsize / POOL_ALIGN];
+    thread_cache.free[bsize / POOL_ALIGN] = b->payload;
+}
+
+/* Hand the cache of an exiting thread over to the depot, and its count of
+ * blocks over to retired_count. What is left of its chunk stays unused.
+ */
+static void cache_retire(void *arg)
+{
+    thread_cache_t *cache = arg;
+    for (size_t i = 0; i < QUARANTINE_SIZE; i++) {
+        if (cache->quarantine[i])
+            pool_release(cache->quarantine[i]);
+        cache->quarantine[i] = NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (size_t c = 0; c < POOL_CLASSES; c++) {
+        void **link = cache->free[c];
+        if (!link)
+            continue;
+        while (*link)
+            link = *link;
+        *link = pool_depot[c];
+        pool_depot[c] = cache->free[c];
+        cache->free[c] = NULL;
+    }
+    retired_count += cache->allocated;
+    cache->allocated = 0;
+    if (cache->prev)
+        cache->prev->next = cache->next;
+    else
+        cache_threads = cache->next;
+    if (cache->next)
+        cache->next->prev = cache->prev;
+    cache->registered = false;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void cache_key_create(void)
+{
+    pthread_key_create(&cache_key, cache_retire);
+}
+
+/* Return the cache of the calling thread, registering it on first use */
+static inline thread_cache_t *cache_get(void)
+{
+    thread_cache_t *cache = &thread_cache;
+    if (!cache->registered) {
+        pthread_once(&cache_key_once, cache_key_create);
+        pthread_setspecific(cache_key, cache);
+        pthread_mutex_lock(&cache_lock);
+        cache->prev = NULL;
+        cache->next = cache_threads;
+        if (cache_threads)
+            cache_threads->prev = cache;
+        cache_threads = cache;
+        pthread_mutex_unlock(&cache_lock);
+        cache->registered = true;
+    }
+    return cache;
+}
+
+/* Add delta, possibly wrapped around, to the count of allocated blocks. Only
+ * the owner thread writes its count, so no atomic read-modify-write is needed.
+ */
+static inline void count_blocks(size_t delta)
+{
+    thread_cache_t *cache = cache_get();
+    size_t n = atomic_load_explicit(&cache->allocated, memory_order_relaxed);
+    atomic_store_explicit(&cache->allocated, n + delta, memory_order_relaxed);
+}
+
+static block_element_t *pool_alloc(size_t bsize)
+{
+    size_t c = bsize / POOL_ALIGN;
+    if (!thread_cache.free[c] && pool_depot[c]) {
+        pthread_mutex_lock(&cache_lock);
+        thread_cache.free[c] = pool_depot[c];
+        pool_depot[c] = NULL;
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    void **link = thread_cache.free[c];
+    if (link) {
+        thread_cache.free[c] = *link;
+        return (block_element_t *) ((size_t) link - sizeof(block_element_t));
+    }
+
+    pool_chunk_t *chunk = thread_cache.chunk;
+    if (!chunk || POOL_CHUNK - chunk->used < bsize) {
+        chunk = malloc(sizeof(pool_chunk_t) + POOL_CHUNK);
+        if (!chunk)
+            return NULL;
+        chunk->used = 0;
+        pthread_mutex_lock(&cache_lock);
+        chunk->next = pool_chunks;
+        pool_chunks = chunk;
+        pthread_mutex_unlock(&cache_lock);
+        thread_cache.chunk = chunk;
+    }
+    block_element_t *b = (block_element_t *) (chunk->data + chunk->used);
+    chunk->used += bsize;
+    return b;
+}
+
+/* Find header of block, given its payload, and stop tracking it if untrack.
+ * Signal error and return NULL if doesn't seem like legitimate block
  */
-static block_element_t *find_header(void *p)
+static block_element_t *find_header(void *p, bool untrack)
 {
     if (!p) {
         report_event(MSG_ERROR, "Attempting to free null block");
@@ -79,40 +474,173 @@ static block_element_t *find_header(void *p)
 
     block_element_t *b =
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
-    if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+    if (cautious_mode || untrack) {
+        /* Make sure this is really an allocated block, in the same lookup
+         * that forgets it when freeing
+         */
+        bool tracked = untrack ? track_del(b) : track_has(b);
+        if (cautious_mode && !tracked) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
             error_occurred = true;
+            return NULL;
         }
     }
 
-    if (b->magic_header != MAGICHEADER) {
+    if (b->magic_header != MAGICHEADER && b->magic_header != MAGICALIGNED) {
         report_event(
             MSG_ERROR,
             "Attempted to free unallocated or corrupted block.  Address = %p",
             p);
         error_occurred = true;
+        return NULL;
     }
 
     return b;
 }
 
-/* Given pointer to block, find its footer */
-static size_t *find_footer(block_element_t *b)
+/* Fill in the header and footer of a fresh block and start tracking it */
+static void *block_setup(block_element_t *b, size_t size, size_t magic)
 {
-    // cppcheck-suppress nullPointerRedundantCheck
-    size_t *p =
-        (size_t *) ((size_t) b + b->payload_size + sizeof(block_element_t));
-    return p;
+    b->magic_header = magic;
+    b->payload_size = size;
+    *find_footer(b) = MAGICFOOTER;
+    if (poison_payload())
+        memset(b->payload, FILLCHAR, size);
+    if (!track_add(b)) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+    }
+    count_blocks(1);
+    return b->payload;
+}
+
+static void *block_new(size_t size)
+{
+    size_t bsize = pool_block_size(size);
+    block_element_t *b =
+        bsize > POOL_MAX_BLOCK
+            ? malloc(size + sizeof(block_element_t) + sizeof(size_t))
+            : pool_alloc(bsize);
+    if (!b) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
+    return block_setup(b, size, MAGICHEADER);
+}
+
+static void *block_new_aligned(size_t alignment, size_t size)
+{
+    /* The header and the alignment word fit in the padding before the
+     * payload, since alignment is at least twice the size of the header.
+     */
+    void *base;
+    if (posix_memalign(&base, alignment, alignment + size + sizeof(size_t))) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
+    block_element_t *b = (block_element_t *) ((size_t) base + alignment -
+                                              sizeof(block_element_t));
+    ((size_t *) b)[-1] = alignment;
+    return block_setup(b, size, MAGICALIGNED);
+}
+
+/* Poison an untracked block that passed the checks of find_header() and hand
+ * it back to its pool or to the system
+ */
+static void block_release(block_element_t *b)
+{
+    size_t magic = b->magic_header;
+    b->magic_header = poison_payload() ? MAGICFREE : MAGICFREERAW;
+    *find_footer(b) = b->magic_header;
+    if (b->magic_header == MAGICFREE)
+        memset(b->payload, FILLCHAR, b->payload_size);
+
+    count_blocks(-1);
+    if (magic == MAGICALIGNED) {
+        size_t alignment = ((size_t *) b)[-1];
+        free((void *) ((size_t) b->payload - alignment));
+        return;
+    }
+    /* Only a poisoned large block has anything to check once quarantined */
+    if (pool_block_size(b->payload_size) > POOL_MAX_BLOCK &&
+        b->magic_header != MAGICFREE) {
+        free(b);
+        return;
+    }
+
+    thread_cache_t *cache = &thread_cache;
+    block_element_t *old = cache->quarantine[cache->quarantine_next];
+    cache->quarantine[cache->quarantine_next] = b;
+    cache->quarantine_next = (cache->quarantine_next + 1) % QUARANTINE_SIZE;
+    if (old)
+        pool_release(old);
+}
+
+/* Record the new payload size of block b and poison what it gained */
+static void block_set_size(block_element_t *b, size_t size)
+{
+    size_t old_size = b->payload_size;
+    b->payload_size = size;
+    *find_footer(b) = MAGICFOOTER;
+    if (size > old_size && poison_payload())
+        memset(b->payload + old_size, FILLCHAR, size - old_size);
+}
+
+/* Try to give pool or aligned block b a payload of size bytes without moving
+ * it. Pool blocks keep their place if the footprint stays in the same size
+ * class, or if they were the last carved out of the current chunk, which has
+ * room for the new footprint. Aligned blocks may only shrink. Return false,
+ * leaving b untouched, if it has to move.
+ */
+static bool block_resize(block_element_t *b, size_t size)
+{
+    size_t bsize = pool_block_size(b->payload_size);
+    size_t new_bsize = pool_block_size(size);
+    if (b->magic_header == MAGICALIGNED) {
+        if (size > b->payload_size)
+            return false;
+    } else {
+        pool_chunk_t *chunk = thread_cache.chunk;
+        if (new_bsize > POOL_MAX_BLOCK)
+            return false;
+        if (new_bsize != bsize) {
+            if (!chunk ||
+                (unsigned char *) b + bsize != chunk->data + chunk->used ||
+                chunk->used - bsize + new_bsize > POOL_CHUNK)
+                return false;
+            chunk->used = chunk->used - bsize + new_bsize;
+        }
+    }
+    block_set_size(b, size);
+    return true;
+}
+
+/* Resize block b from the system allocator there, which may move it. Return
+ * the new header, or NULL if the system is out of memory and b stays as is.
+ */
+static block_element_t *block_realloc(block_element_t *b, size_t size)
+{
+    /* Untrack the block first, in case another thread gets the old address
+     * from the system as soon as realloc() releases it
+     */
+    track_del(b);
+    block_element_t *nb =
+        realloc(b, size + sizeof(block_element_t) + sizeof(size_t));
+    if (!track_add(nb ? nb : b)) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+    }
+    if (!nb) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
+    block_set_size(nb, size);
+    return nb;
 }
 
 /* Implementation of application functions */
@@ -129,31 +657,7 @@ void *test_malloc(size_t size)
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
-    if (!new_block) {
-        report_event(MSG_FATAL, "Couldn't allocate any more memory");
-        error_occurred = true;
-    }
-
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->magic_header = MAGICHEADER;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
-    void *p = (void *) &new_block->payload;
-    memset(p, FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
-
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
-
-    return p;
+    return block_new(size);
 }
 
 // cppcheck-suppress unusedFunction
@@ -168,6 +672,85 @@ void *test_calloc(size_t nelem, size_t elsize)
     return ptr;
 }
 
+// cppcheck-suppress unusedFunction
+void *test_realloc(void *p, size_t size)
+{
+    if (!p)
+        return test_malloc(size);
+
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to realloc disallowed");
+        return NULL;
+    }
+
+    block_element_t *b = find_header(p, false);
+    if (!b)
+        return NULL;
+    if (*find_footer(b) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to reallocate it",
+                     p);
+        error_occurred = true;
+    }
+
+    if (fail_allocation()) {
+        report_event(MSG_WARN, "Realloc returning NULL");
+        return NULL;
+    }
+
+    /* b must not be read once block_realloc() may have released it */
+    size_t magic = b->magic_header;
+    size_t old_size = b->payload_size;
+    if (magic == MAGICHEADER && pool_block_size(old_size) > POOL_MAX_BLOCK &&
+        pool_block_size(size) > POOL_MAX_BLOCK) {
+        block_element_t *nb = block_realloc(b, size);
+        return nb ? nb->payload : NULL;
+    }
+
+    if (block_resize(b, size))
+        return p;
+
+    /* Move the payload, copying no more than what is live in it */
+    void *np = magic == MAGICALIGNED
+                   ? block_new_aligned(((size_t *) b)[-1], size)
+                   : block_new(size);
+    if (!np)
+        return NULL;
+    memcpy(np, p, size < old_size ? size : old_size);
+    track_del(b);
+    block_release(b);
+    return np;
+}
+
+// cppcheck-suppress unusedFunction
+void *test_aligned_alloc(size_t alignment, size_t size)
+{
+    if (!alignment || (alignment & (alignment - 1))) {
+        report_event(MSG_ERROR,
+                     "Alignment %zu requested for a block is not a power of 2",
+                     alignment);
+        error_occurred = true;
+        return NULL;
+    }
+
+    /* Every block from test_malloc() is aligned to POOL_ALIGN already */
+    if (alignment <= POOL_ALIGN)
+        return test_malloc(size);
+
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to malloc disallowed");
+        return NULL;
+    }
+
+    if (fail_allocation()) {
+        report_event(MSG_WARN, "Malloc returning NULL");
+        return NULL;
+    }
+
+    return block_new_aligned(alignment, size);
+}
+
 void test_free(void *p)
 {
     if (noallocate_mode) {
@@ -178,7 +761,9 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_element_t *b = find_header(p);
+    block_element_t *b = find_header(p, true);
+    if (!b)
+        return;
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
@@ -187,22 +772,7 @@ void test_free(void *p)
                      p);
         error_occurred = true;
     }
-    b->magic_header = MAGICFREE;
-    *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
-
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
-
-    free(b);
-    allocated_count--;
+    block_release(b);
 }
 
 // cppcheck-suppress unusedFunction
@@ -216,9 +786,277 @@ char *test_strdup(const char *s)
     return memcpy(new, s, len);
 }
 
+/* Round the footprint of an arena block up to the allocation granularity */
+static size_t arena_block_size(size_t size)
+{
+    size_t total = sizeof(arena_block_t) + size + sizeof(size_t);
+    return (total + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+}
+
+static size_t *arena_footer(arena_block_t *b)
+{
+    return (size_t *) ((size_t) b->payload + b->payload_size);
+}
+
+/* Take a block of footprint bsize off the free list of arena, once it is
+ * certain that nothing has written to it since it was freed. The link to the
+ * next free block covers the start of the payload, and its footer too if the
+ * payload is shorter than the link, so only the rest is checked. A damaged
+ * block is reported and left out.
+ */
+static arena_block_t *arena_reuse(test_arena_t *arena, size_t bsize)
+{
+    void **link = arena->free[bsize / ARENA_ALIGN];
+    if (!link)
+        return NULL;
+    arena->free[bsize / ARENA_ALIGN] = *link;
+
+    arena_block_t *b =
+        (arena_block_t *) ((size_t) link - sizeof(arena_block_t));
+    size_t magic = b->magic_header, skip = sizeof(void *);
+    bool intact = (magic == MAGICFREE || magic == MAGICFREERAW) &&
+                  arena_block_size(b->payload_size) == bsize &&
+                  (b->payload_size < skip || *arena_footer(b) == magic);
+    if (intact && magic == MAGICFREE && b->payload_size > skip)
+        intact = b->payload[skip] == FILLCHAR &&
+                 !memcmp(b->payload + skip, b->payload + skip + 1,
+                         b->payload_size - skip - 1);
+    if (!intact) {
+        report_event(MSG_ERROR,
+                     "Block with address %p was modified after being freed",
+                     (void *) &b->payload);
+        error_occurred = true;
+        return NULL;
+    }
+    return b;
+}
+
+static slab_t *arena_new_slab(test_arena_t *arena, size_t size)
+{
+    slab_t *slab = malloc(sizeof(slab_t) + size);
+    if (!slab) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return NULL;
+    }
+    slab->arena = arena;
+    slab->size = size;
+    slab->used = 0;
+    slab->magic = MAGICSLAB;
+    return slab;
+}
+
+/* Insert slab right after the first one, keeping the bump slab in front */
+static void arena_link_slab(test_arena_t *arena, slab_t *slab, bool front)
+{
+    slab_t *prev = front ? NULL : arena->slabs;
+    slab_t *next = prev ? prev->next : arena->slabs;
+    slab->prev = prev;
+    slab->next = next;
+    if (next)
+        next->prev = slab;
+    if (prev)
+        prev->next = slab;
+    else
+        arena->slabs = slab;
+}
+
+static void arena_unlink_slab(slab_t *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        slab->arena->slabs = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+test_arena_t *test_arena_new(void)
+{
+    test_arena_t *arena = test_malloc(sizeof(test_arena_t));
+    if (!arena)
+        return NULL;
+    memset(arena, 0, sizeof(test_arena_t));
+    arena->next_slab = ARENA_MIN_SLAB;
+    arena->refs = 1;
+
+    /* Populate the first slab up front so that the first few insertions into
+     * a new queue cost the same as the later ones.
+     */
+    slab_t *slab = arena_new_slab(arena, arena->next_slab);
+    if (slab)
+        arena_link_slab(arena, slab, true);
+    return arena;
+}
+
+void *test_arena_alloc(test_arena_t *arena, size_t size)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to malloc disallowed");
+        return NULL;
+    }
+
+    if (fail_allocation()) {
+        report_event(MSG_WARN, "Malloc returning NULL");
+        return NULL;
+    }
+
+    size_t bsize = arena_block_size(size);
+    arena_block_t *b;
+    if (bsize > ARENA_MAX_BLOCK) {
+        slab_t *slab = arena_new_slab(arena, bsize);
+        if (!slab)
+            return NULL;
+        arena_link_slab(arena, slab, false);
+        slab->used = bsize;
+        b = (arena_block_t *) slab->data;
+        b->slab = slab;
+    } else if (!(b = arena_reuse(arena, bsize))) {
+        slab_t *slab = arena->slabs;
+        if (!slab || slab->size - slab->used < bsize) {
+            slab = arena_new_slab(arena, arena->next_slab);
+            if (!slab)
+                return NULL;
+            arena_link_slab(arena, slab, true);
+            if (arena->next_slab < ARENA_MAX_SLAB)
+                arena->next_slab <<= 1;
+        }
+        b = (arena_block_t *) (slab->data + slab->used);
+        slab->used += bsize;
+        b->slab = slab;
+    }
+
+    b->magic_header = MAGICHEADER;
+    b->payload_size = size;
+    *arena_footer(b) = MAGICFOOTER;
+    if (poison_payload())
+        memset(b->payload, FILLCHAR, size);
+    arena->live++;
+    count_blocks(1);
+    return b->payload;
+}
+
+void test_arena_free(void *p)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to free disallowed");
+        return;
+    }
+
+    if (!p)
+        return;
+
+    arena_block_t *b = (arena_block_t *) ((size_t) p - sizeof(arena_block_t));
+    if (b->magic_header != MAGICHEADER || !b->slab ||
+        b->slab->magic != MAGICSLAB) {
+        report_event(
+            MSG_ERROR,
+            "Attempted to free unallocated or corrupted block.  Address = %p",
+            p);
+        error_occurred = true;
+        return;
+    }
+
+    slab_t *slab = b->slab;
+    if (cautious_mode && ((unsigned char *) b < slab->data ||
+                          (unsigned char *) b >= slab->data + slab->used)) {
+        report_event(MSG_ERROR,
+                     "Attempted to free unallocated block.  Address = %p", p);
+        error_occurred = true;
+        return;
+    }
+
+    if (*arena_footer(b) != MAGICFOOTER) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to free it",
+                     p);
+        error_occurred = true;
+    }
+    b->magic_header = poison_payload() ? MAGICFREE : MAGICFREERAW;
+    *arena_footer(b) = b->magic_header;
+    if (b->magic_header == MAGICFREE)
+        memset(p, FILLCHAR, b->payload_size);
+
+    test_arena_t *arena = slab->arena;
+    arena->live--;
+    count_blocks(-1);
+
+    size_t bsize = arena_block_size(b->payload_size);
+    if (bsize > ARENA_MAX_BLOCK) {
+        arena_unlink_slab(slab);
+        free(slab);
+        return;
+    }
+    *(void **) p = arena->free[bsize / ARENA_ALIGN];
+    arena->free[bsize / ARENA_ALIGN] = p;
+}
+
+void test_arena_absorb(test_arena_t *dst, test_arena_t *src)
+{
+    if (!dst || !src || dst == src)
+        return;
+
+    /* Blocks on the free lists of src stay parked in their slabs; they are
+     * reclaimed when dst is destroyed.
+     */
+    while (src->slabs) {
+        slab_t *slab = src->slabs;
+        arena_unlink_slab(slab);
+        slab->arena = dst;
+        arena_link_slab(dst, slab, false);
+    }
+    dst->live += src->live;
+    src->live = 0;
+    memset(src->free, 0, sizeof(src->free));
+}
+
+test_arena_t *test_arena_share(test_arena_t *arena)
+{
+    if (arena)
+        arena->refs++;
+    return arena;
+}
+
+bool test_arena_shared(test_arena_t *arena)
+{
+    return arena && arena->refs > 1;
+}
+
+void test_arena_destroy(test_arena_t *arena, size_t expected)
+{
+    if (!arena || --arena->refs)
+        return;
+
+    /* Blocks beyond the expected ones were leaked by their owner. They go
+     * along with their slabs but stay counted, as a leaked block would.
+     */
+    if (arena->live < expected) {
+        report_event(MSG_ERROR,
+                     "Arena holds %zu blocks, but %zu are expected in it",
+                     arena->live, expected);
+        error_occurred = true;
+        expected = arena->live;
+    }
+
+    while (arena->slabs) {
+        slab_t *slab = arena->slabs;
+        arena->slabs = slab->next;
+        slab->magic = MAGICFREE;
+        free(slab);
+    }
+    count_blocks(-expected);
+    test_free(arena);
+}
+
 size_t allocation_check()
 {
-    return allocated_count;
+    pthread_mutex_lock(&cache_lock);
+    size_t n = retired_count;
+    for (thread_cache_t *cache = cache_threads; cache; cache = cache->next)
+        n += cache->allocated;
+    pthread_mutex_unlock(&cache_lock);
+    return n;
 }
 
 /* Implementation of functions for testing */
@@ -242,9 +1080,7 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
 /* Prepare for a risky operation using setjmp.
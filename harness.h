@@ -8,13 +8,46 @@
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ * Any thread may allocate and free blocks, including blocks allocated by
+ * another thread. Small blocks are cached per thread, and the table of
+ * allocated blocks is split into shards that are locked separately.
  */
 
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
-/* FIXME: provide test_realloc as well */
+/* Resize a block, in place when its slack or the pool allows it. Only the
+ * live payload is copied when it has to move, and the block keeps its
+ * alignment if it came from test_aligned_alloc().
+ */
+void *test_realloc(void *p, size_t size);
+/* Allocate a block whose payload is aligned to a power of 2, such as the
+ * size of a cache line. It is released with test_free().
+ */
+void *test_aligned_alloc(size_t alignment, size_t size);
+
+/* Arena of small blocks carved out of larger slabs.
+ * Each block carries the same magic header and footer as test_malloc() and
+ * counts towards allocation_check(), but destroying the arena releases every
+ * block it still owns at once, in time proportional to the number of slabs.
+ * An arena is not locked, so only one thread at a time may use it.
+ */
+typedef struct __test_arena test_arena_t;
+
+test_arena_t *test_arena_new(void);
+void *test_arena_alloc(test_arena_t *arena, size_t size);
+void test_arena_free(void *p);
+/* Hand every slab and live block of src over to dst, leaving src empty */
+void test_arena_absorb(test_arena_t *dst, test_arena_t *src);
+/* Add an owner to the arena, which is released once every owner destroyed it */
+test_arena_t *test_arena_share(test_arena_t *arena);
+bool test_arena_shared(test_arena_t *arena);
+/* Release an owner of the arena. The last one also releases every slab, of
+ * which expected blocks are still in use by that owner; any more were leaked
+ * and keep counting towards allocation_check().
+ */
+void test_arena_destroy(test_arena_t *arena, size_t expected);
 
 #ifdef INTERNAL
 
@@ -24,6 +57,15 @@ size_t allocation_check();
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Fill one payload out of this many with FILLCHAR when allocated and again
+ * when freed: 1 poisons every block, 0 only writes the magic header and
+ * footer. Blocks freed with a poisoned payload are checked for late writes:
+ * test_malloc() blocks when they leave the quarantine, arena blocks when they
+ * are handed out again. Aligned blocks and arena blocks larger than a slab
+ * class go back to the system at once and are never checked.
+ */
+extern int poison_rate;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -40,7 +82,8 @@ void set_noallocate_mode(bool noallocate);
 bool error_check();
 
 /* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
+ * Function returns true for initial return, false for error return.
+ * Each thread has an exception context of its own.
  */
 bool exception_setup(bool limit_time);
 
@@ -56,6 +99,8 @@ void trigger_exception(char *msg);
 /* Tested program use our versions of malloc and free */
 #define malloc test_malloc
 #define free test_free
+#define realloc test_realloc
+#define aligned_alloc test_aligned_alloc
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
@@ -958,9 +958,10 @@ static int line_edit(int stdin_fd,
                 web_connfd =
                     accept(web_fd, (struct sockaddr *) &clientaddr, &clientlen);
                 char *p = web_recv(web_connfd, &clientaddr);
-                strncpy(buf, p, strlen(p) + 1);
+                size_t len = strlen(p);
+                strncpy(buf, p, len + 1);
                 free(p);
-                return strlen(p);
+                return len;
             } else if (FD_ISSET(stdin_fd, &set)) {
                 int nread = read(l.ifd, &c, 1);
                 if (nread <= 0)
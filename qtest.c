@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -53,7 +54,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -75,8 +75,15 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Whether rh/rt copy the removed strings out, or read them in the element */
+static int remove_copy = 1;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
+/* Number of random strings generated and inserted at once by ih/it RAND */
+#define INSERT_BATCH 256
+/* Number of elements removed at once by rh/rt with a count */
+#define REMOVE_BATCH 256
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 /* For queue_insert and queue_remove */
 typedef enum {
@@ -101,9 +108,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -116,7 +120,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -178,6 +181,21 @@ static void fill_rand_string(char *buf, size_t buf_size)
     buf[len] = '\0';
 }
 
+/* Run a dudect check on queues of the given layout */
+static bool simulate(bool (*is_const)(void), int backend)
+{
+    int saved = q_backend;
+    q_backend = backend;
+    bool ok = is_const();
+    q_backend = saved;
+    if (!ok) {
+        report(1, "ERROR: Probably not constant time or wrong implementation");
+        return false;
+    }
+    report(1, "Probably constant time");
+    return ok;
+}
+
 /* insertion */
 static bool queue_insert(position_t pos, int argc, char *argv[])
 {
@@ -186,19 +204,14 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
-        bool ok =
-            pos == POS_TAIL ? is_insert_tail_const() : is_insert_head_const();
-        if (!ok) {
-            report(1,
-                   "ERROR: Probably not constant time or wrong implementation");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
+        return simulate(
+            pos == POS_TAIL ? is_insert_tail_const : is_insert_head_const,
+            q_backend);
     }
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
+    static char randstr_buf[INSERT_BATCH][MAX_RANDSTR_LEN];
+    char *randstrs[INSERT_BATCH];
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -216,7 +229,8 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
 
     if (!strcmp(inserts, "RAND")) {
         need_rand = true;
-        inserts = randstr_buf;
+        for (int i = 0; i < INSERT_BATCH; i++)
+            randstrs[i] = randstr_buf[i];
     }
 
     if (!current || !current->q)
@@ -225,22 +239,30 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
     error_check();
 
     if (current && exception_setup(true)) {
-        for (int r = 0; ok && r < reps; r++) {
-            if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
-            bool rval = pos == POS_TAIL ? q_insert_tail(current->q, inserts)
-                                        : q_insert_head(current->q, inserts);
-            if (rval) {
-                current->size++;
-                element_t *entry =
-                    pos == POS_TAIL
-                        ? list_last_entry(current->q, element_t, list)
-                        : list_first_entry(current->q, element_t, list);
-                char *cur_inserts = entry->value;
+        for (int r = 0; ok && r < reps;) {
+            /* The first element goes alone so that the checks below see the
+             * first two insertions apart
+             */
+            int n = r == 0 ? 1 : reps - r;
+            if (need_rand) {
+                n = n < INSERT_BATCH ? n : INSERT_BATCH;
+                for (int i = 0; i < n; i++)
+                    fill_rand_string(randstrs[i], MAX_RANDSTR_LEN);
+            }
+            char **strs = need_rand ? randstrs : &inserts;
+            int k = pos == POS_TAIL
+                        ? q_insert_tail_n(current->q, strs, n, !need_rand)
+                        : q_insert_head_n(current->q, strs, n, !need_rand);
+            if (k) {
+                current->size += k;
+                element_t *entry = pos == POS_TAIL
+                                       ? q_peek_tail(current->q)
+                                       : q_peek_head(current->q);
+                char *cur_inserts = element_value(entry);
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
-                } else if (r == 0 && inserts == cur_inserts) {
+                } else if (r == 0 && strs[0] == cur_inserts) {
                     report(1,
                            "ERROR: Need to allocate and copy string for new "
                            "queue element");
@@ -254,16 +276,20 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                     break;
                 }
                 lasts = cur_inserts;
-            } else {
+                r += k;
+            }
+            if (k < n) {
+                char *failed = strs[need_rand ? k : 0];
                 fail_count++;
                 if (fail_count < fail_limit)
-                    report(2, "Insertion of %s failed", inserts);
+                    report(2, "Insertion of %s failed", failed);
                 else {
                     report(1,
                            "ERROR: Insertion of %s failed (%d failures total)",
-                           inserts, fail_count);
+                           failed, fail_count);
                     ok = false;
                 }
+                r++;
             }
             ok = ok && !error_check();
         }
@@ -286,6 +312,117 @@ static bool do_it(int argc, char *argv[])
     return queue_insert(POS_TAIL, argc, argv);
 }
 
+/* Remove n elements at once, comparing each to str unless it equals RAND */
+static bool queue_remove_n(position_t pos, char *argv[])
+{
+    int reps;
+    if (!get_int(argv[2], &reps) || reps < 0) {
+        report(1, "Invalid number of removals '%s'", argv[2]);
+        return false;
+    }
+
+    size_t bufsize = (size_t) REMOVE_BATCH * (string_length + 1);
+    char *removes = malloc(bufsize + STRINGPAD);
+    size_t *offsets = malloc(sizeof(size_t) * REMOVE_BATCH);
+    if (!removes || !offsets) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for removed strings");
+        free(removes);
+        free(offsets);
+        return false;
+    }
+    memset(removes + bufsize, 'X', STRINGPAD);
+
+    bool check = strcmp(argv[1], "RAND");
+    bool ok = true;
+    if (!current || !current->size)
+        report(3, "Warning: Calling remove %s on empty queue",
+               pos == POS_TAIL ? "tail" : "head");
+    error_check();
+
+    int r = 0;
+    if (current && !remove_copy && exception_setup(true)) {
+        while (ok && r < reps) {
+            element_t *re = pos == POS_TAIL ? q_take_tail(current->q)
+                                            : q_take_head(current->q);
+            if (!re) {
+                fail_count++;
+                if (!check && fail_count < fail_limit) {
+                    report(2, "Removal from queue failed");
+                } else {
+                    report(1,
+                           "ERROR: Removal from queue failed (%d failures "
+                           "total)",
+                           fail_count);
+                    ok = false;
+                }
+                break;
+            }
+            if (check && strncmp(element_value(re), argv[1], string_length)) {
+                report(1, "ERROR: Removed value %.*s != expected value %s",
+                       string_length, element_value(re), argv[1]);
+                ok = false;
+            }
+            q_release_element(re);
+            current->size--;
+            r++;
+            ok = ok && !error_check();
+        }
+    }
+    exception_cancel();
+    while (current && ok && r < reps) {
+        int n = reps - r < REMOVE_BATCH ? reps - r : REMOVE_BATCH;
+        int k = 0;
+        if (exception_setup(true))
+            k = pos == POS_TAIL ? q_remove_tail_n(current->q, n, removes,
+                                                  bufsize, offsets)
+                                : q_remove_head_n(current->q, n, removes,
+                                                  bufsize, offsets);
+        exception_cancel();
+
+        int i = 0;
+        while (i < STRINGPAD && removes[bufsize + i] == 'X')
+            i++;
+        if (i != STRINGPAD) {
+            report(1,
+                   "ERROR: copying of strings in remove_n overflowed "
+                   "destination buffer.");
+            ok = false;
+        }
+        for (i = 0; ok && check && i < k; i++) {
+            if (strncmp(removes + offsets[i], argv[1], string_length)) {
+                report(1, "ERROR: Removed value %s != expected value %s",
+                       removes + offsets[i], argv[1]);
+                ok = false;
+            }
+        }
+        current->size -= k;
+        r += k;
+
+        ok = ok && !error_check();
+        if (k < n) {
+            fail_count++;
+            if (!check && fail_count < fail_limit) {
+                report(2, "Removal from queue failed");
+            } else {
+                report(1,
+                       "ERROR: Removal from queue failed (%d failures total)",
+                       fail_count);
+                ok = false;
+            }
+            break;
+        }
+    }
+    if (ok)
+        report(2, "Removed %d elements from queue", r);
+
+    q_show(3);
+
+    free(removes);
+    free(offsets);
+    return ok;
+}
+
 static bool queue_remove(position_t pos, int argc, char *argv[])
 {
     /* FIXME: It is known that both functions is_remove_tail_const() and
@@ -298,23 +435,20 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
-        bool ok =
-            pos == POS_TAIL ? is_remove_tail_const() : is_remove_head_const();
-        if (!ok) {
-            report(1,
-                   "ERROR: Probably not constant time or wrong implementation");
-            return false;
-        }
-        report(1, "Probably constant time");
-        return ok;
+        return simulate(
+            pos == POS_TAIL ? is_remove_tail_const : is_remove_head_const,
+            q_backend);
     }
 #endif
 
-    if (argc != 1 && argc != 2) {
-        report(1, "%s needs 0-1 arguments", argv[0]);
+    if (argc != 1 && argc != 2 && argc != 3) {
+        report(1, "%s needs 0-2 arguments", argv[0]);
         return false;
     }
 
+    if (argc == 3)
+        return queue_remove_n(pos, argv);
+
     char *removes = malloc(string_length + STRINGPAD + 1);
     if (!removes) {
         report(1,
@@ -347,15 +481,32 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
     error_check();
 
     element_t *re = NULL;
-    if (current && exception_setup(true))
-        re = pos == POS_TAIL
-                 ? q_remove_tail(current->q, removes, string_length + 1)
-                 : q_remove_head(current->q, removes, string_length + 1);
+    if (current && exception_setup(true)) {
+        if (!remove_copy)
+            re = pos == POS_TAIL ? q_take_tail(current->q)
+                                 : q_take_head(current->q);
+        else
+            re = pos == POS_TAIL
+                     ? q_remove_tail(current->q, removes, string_length + 1)
+                     : q_remove_head(current->q, removes, string_length + 1);
+    }
     exception_cancel();
 
     bool is_null = re ? false : true;
 
-    if (!is_null) {
+    if (!is_null && !remove_copy) {
+        /* Nothing was copied, so check the string where it is */
+        const char *value = element_value(re);
+        report(2, "Removed %.*s from queue", string_length, value);
+        if (check && strncmp(value, checks, string_length)) {
+            report(1, "ERROR: Removed value %.*s != expected value %s",
+                   string_length, value, checks);
+            ok = false;
+        }
+        check = false;
+        q_release_element(re);
+        current->size--;
+    } else if (!is_null) {
         // q_remove_head and q_remove_tail are not responsible for releasing
         // node
         q_release_element(re);
@@ -415,10 +566,130 @@ static inline bool do_rt(int argc, char *argv[])
     return queue_remove(POS_TAIL, argc, argv);
 }
 
+static int cmp_string(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Number of occurrences of s in the sorted array strs of n strings */
+static int count_string(char **strs, int n, const char *s)
+{
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(strs[mid], s) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    int cnt = 0;
+    while (lo + cnt < n && !strcmp(strs[lo + cnt], s))
+        cnt++;
+    return cnt;
+}
+
+/* Delete duplicates from a queue in arbitrary order and check that exactly
+ * the strings occurring once survive, in their original order
+ */
+static bool dedup_unsorted()
+{
+    int n = current->size;
+    char **strs = malloc(sizeof(char *) * (n + 1));
+    char **sorted = malloc(sizeof(char *) * (n + 1));
+    if (!strs || !sorted) {
+        free(strs);
+        free(sorted);
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for duplicate "
+               "checking");
+        return false;
+    }
+
+    int cnt = 0;
+    element_t *item;
+    q_link(current->q);
+    list_for_each_entry (item, current->q, list) {
+        if (cnt == n || !(strs[cnt] = strdup(element_value(item))))
+            break;
+        cnt++;
+    }
+
+    bool ok = cnt == n, done = false;
+    if (!ok) {
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for duplicate "
+               "checking");
+    } else {
+        if (exception_setup(true))
+            done = q_delete_dup_unsorted(current->q);
+        exception_cancel();
+        /* do_dedup() turned a null queue away, so unless the call raised an
+         * error, failing means that the table could not be allocated
+         */
+        if (error_check()) {
+            ok = false;
+        } else if (!done) {
+            fail_count++;
+            if (fail_count < fail_limit) {
+                report(2, "Allocation for delete duplicate failed");
+            } else {
+                report(1,
+                       "ERROR: Allocation for delete duplicate failed (%d "
+                       "failures total)",
+                       fail_count);
+                ok = false;
+            }
+        }
+    }
+
+    if (ok && !done) {
+        /* A failed call has to leave the queue as it was */
+        struct list_head *l_tmp = current->q->next;
+        for (int i = 0; i < n && ok; i++, l_tmp = l_tmp->next)
+            ok = l_tmp != current->q &&
+                 !strcmp(element_value(list_entry(l_tmp, element_t, list)),
+                         strs[i]);
+        ok = ok && l_tmp == current->q;
+        if (!ok)
+            report(1, "ERROR: Failed delete duplicate changed the queue");
+    } else if (ok) {
+        memcpy(sorted, strs, sizeof(char *) * n);
+        qsort(sorted, n, sizeof(char *), cmp_string);
+
+        struct list_head *l_tmp = current->q->next;
+        for (int i = 0; i < n; i++) {
+            if (count_string(sorted, n, strs[i]) > 1) {
+                current->size--;
+            } else if (l_tmp != current->q &&
+                       !strcmp(element_value(list_entry(l_tmp, element_t,
+                                                        list)),
+                               strs[i])) {
+                l_tmp = l_tmp->next;
+            } else {
+                ok = false;
+            }
+        }
+        ok = ok && l_tmp == current->q;
+        if (!ok)
+            report(1,
+                   "ERROR: Duplicate strings are in queue or distinct strings "
+                   "are not in queue in their original order");
+    }
+
+    for (int i = 0; i < cnt; i++)
+        free(strs[i]);
+    free(strs);
+    free(sorted);
+
+    q_show(3);
+    return ok && !error_check();
+}
+
 static bool do_dedup(int argc, char *argv[])
 {
-    if (argc != 1) {
-        report(1, "%s takes no arguments", argv[0]);
+    bool unsorted = argc == 2 && !strcmp(argv[1], "unsorted");
+    if (argc != 1 && !unsorted) {
+        report(1, "%s takes no arguments other than 'unsorted'", argv[0]);
         return false;
     }
 
@@ -427,10 +698,14 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
+    if (unsorted)
+        return dedup_unsorted();
+
     LIST_HEAD(l_copy);
     element_t *item = NULL, *tmp = NULL;
 
     // Copy current->q to l_copy
+    q_link(current->q);
     if (current->q && !list_empty(current->q)) {
         list_for_each_entry (item, current->q, list) {
             size_t slen;
@@ -438,19 +713,20 @@ static bool do_dedup(int argc, char *argv[])
             if (!tmp)
                 break;
             INIT_LIST_HEAD(&tmp->list);
-            slen = strlen(item->value) + 1;
-            tmp->value = malloc(slen);
-            if (!tmp->value) {
+            slen = strlen(element_value(item)) + 1;
+            tmp->is_inline = false;
+            tmp->value.ptr = malloc(slen);
+            if (!tmp->value.ptr) {
                 free(tmp);
                 break;
             }
-            memcpy(tmp->value, item->value, slen);
+            memcpy(tmp->value.ptr, element_value(item), slen);
             list_add_tail(&tmp->list, &l_copy);
         }
         // Return false if the loop does not leave properly
         if (&item->list != current->q) {
             list_for_each_entry_safe (item, tmp, &l_copy, list) {
-                free(item->value);
+                free(item->value.ptr);
                 free(item);
             }
             report(1,
@@ -467,7 +743,7 @@ static bool do_dedup(int argc, char *argv[])
 
     if (!ok) {
         list_for_each_entry_safe (item, tmp, &l_copy, list) {
-            free(item->value);
+            free(item->value.ptr);
             free(item);
         }
         report(1, "ERROR: Calling delete duplicate on null queue");
@@ -481,14 +757,14 @@ static bool do_dedup(int argc, char *argv[])
         // Skip comparison with new list if the string is duplicate
         bool is_next_dup =
             item->list.next != &l_copy &&
-            strcmp(list_entry(item->list.next, element_t, list)->value,
-                   item->value) == 0;
+            strcmp(element_value(list_entry(item->list.next, element_t, list)),
+                   element_value(item)) == 0;
         if (is_this_dup || is_next_dup) {
             // Update list size
             current->size--;
         } else if (l_tmp != current->q &&
-                   strcmp(list_entry(l_tmp, element_t, list)->value,
-                          item->value) == 0)
+                   strcmp(element_value(list_entry(l_tmp, element_t, list)),
+                          element_value(item)) == 0)
             l_tmp = l_tmp->next;
         else
             ok = false;
@@ -502,7 +778,7 @@ static bool do_dedup(int argc, char *argv[])
                "not in queue");
 
     list_for_each_entry_safe (item, tmp, &l_copy, list) {
-        free(item->value);
+        free(item->value.ptr);
         free(item);
     }
 
@@ -611,13 +887,15 @@ bool do_sort(int argc, char *argv[])
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (!descend && strcmp(item->value, next_item->value) > 0) {
+            if (!descend &&
+                q_strcmp(element_value(item), element_value(next_item)) > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
                 break;
             }
 
-            if (descend && strcmp(item->value, next_item->value) < 0) {
+            if (descend &&
+                q_strcmp(element_value(item), element_value(next_item)) < 0) {
                 report(1, "ERROR: Not sorted in descending order");
                 ok = false;
                 break;
@@ -636,6 +914,16 @@ static bool do_dm(int argc, char *argv[])
         return false;
     }
 
+    /* Only a linked list keeps track of its middle node, the other layouts
+     * look for it in linear time
+     */
+    if (simulation) {
+        if (q_backend != QUEUE_LINKED)
+            report(1, "Measuring dm on a linked list instead of backend %d",
+                   q_backend);
+        return simulate(is_delete_mid_const, QUEUE_LINKED);
+    }
+
     if (!current || !current->q) {
         report(3, "Warning: Try to access null queue");
         return false;
@@ -655,6 +943,448 @@ static bool do_dm(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* A positional operation given a valid position fails only when it cannot
+ * allocate its index or new header. Count such a failure towards fail_limit,
+ * unless the call raised an error of its own, and return whether it is
+ * allowed. The queue must then be left as it was.
+ */
+static bool position_failed(const char *what, int i)
+{
+    if (error_check())
+        return false;
+    fail_count++;
+    if (fail_count >= fail_limit) {
+        report(1,
+               "ERROR: Allocation failed for %s at position %d (%d failures "
+               "total)",
+               what, i, fail_count);
+        return false;
+    }
+    report(2, "Allocation failed for %s at position %d", what, i);
+    if (q_size(current->q) != current->size) {
+        report(1, "ERROR: Queue size changed by failed %s", what);
+        return false;
+    }
+    return true;
+}
+
+static bool do_get(int argc, char *argv[])
+{
+    int i = 0;
+    if (argc != 2 && argc != 3) {
+        report(1, "%s needs 1-2 arguments", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &i)) {
+        report(1, "Invalid position '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
+
+    element_t *e = NULL;
+    if (exception_setup(true))
+        e = q_get(current->q, i);
+    exception_cancel();
+
+    bool ok = true;
+    if (!e && i >= 0 && i < current->size) {
+        ok = position_failed("lookup", i);
+    } else if (!e) {
+        report(1, "ERROR: No element at position %d of queue of size %d", i,
+               (int) current->size);
+        ok = false;
+    } else if (argc == 3 && strcmp(element_value(e), argv[2])) {
+        report(1, "ERROR: Value %s at position %d != expected value %s",
+               element_value(e), i, argv[2]);
+        ok = false;
+    } else {
+        report(2, "Element at position %d = %s", i, element_value(e));
+    }
+    return ok && !error_check();
+}
+
+static bool do_delete(int argc, char *argv[])
+{
+    int i = 0;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &i)) {
+        report(1, "Invalid position '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
+
+    bool ok = false;
+    if (exception_setup(true))
+        ok = q_delete_at(current->q, i);
+    exception_cancel();
+
+    if (ok)
+        --current->size;
+    else if (i >= 0 && i < current->size)
+        ok = position_failed("deletion", i);
+    else
+        report(1, "ERROR: Failed to delete position %d of queue of size %d", i,
+               (int) current->size);
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_find(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
+
+    element_t *e = NULL;
+    if (exception_setup(true))
+        e = q_find(current->q, argv[1]);
+    exception_cancel();
+
+    bool ok = true;
+    if (e && strcmp(element_value(e), argv[1])) {
+        report(1, "ERROR: Found value %s while looking for %s",
+               element_value(e), argv[1]);
+        ok = false;
+    } else {
+        report(1, "%s %s in queue", argv[1], e ? "found" : "not found");
+    }
+    return ok && !error_check();
+}
+
+static bool do_del(int argc, char *argv[])
+{
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
+
+    bool ok = false;
+    if (exception_setup(true))
+        ok = q_delete_value(current->q, argv[1]);
+    exception_cancel();
+
+    if (ok)
+        --current->size;
+    else
+        report(1, "ERROR: Failed to delete %s, which is not in queue",
+               argv[1]);
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_split(int argc, char *argv[])
+{
+    int i = 0;
+    if (argc != 2) {
+        report(1, "%s needs 1 argument", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[1], &i)) {
+        report(1, "Invalid position '%s'", argv[1]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
+
+    queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
+    if (!qctx) {
+        report(1, "INTERNAL ERROR.  Could not allocate queue context");
+        return false;
+    }
+
+    struct list_head *rest = NULL;
+    if (exception_setup(true))
+        rest = q_split(current->q, i);
+    exception_cancel();
+
+    if (!rest) {
+        free(qctx);
+        if (i >= 0 && i <= current->size)
+            return position_failed("split", i) && !error_check();
+        report(1, "ERROR: Failed to split queue of size %d at position %d",
+               (int) current->size, i);
+        return false;
+    }
+
+    /* The new queue follows the split one in the chain and becomes current */
+    list_add(&qctx->chain, &current->chain);
+    qctx->q = rest;
+    qctx->size = current->size - i;
+    qctx->id = chain.size++;
+    current->size = i;
+    current = qctx;
+
+    q_show(3);
+    return !error_check();
+}
+
+/* Damage the header or footer of a fresh block and check that the harness
+ * notices, without letting the expected error show up in the output
+ */
+static bool alloc_damaged(bool header)
+{
+    int saved_fail = fail_probability, saved_verb = verblevel;
+    fail_probability = 0;
+    unsigned char *p = test_aligned_alloc(64, 32);
+    fail_probability = saved_fail;
+    if (!p)
+        return false;
+
+    set_verblevel(0);
+    bool caught;
+    if (header) {
+        /* A block whose header is lost cannot be released either, so it is
+         * mended once realloc refused it
+         */
+        ((size_t *) p)[-1] ^= 1;
+        caught = !test_realloc(p, 64) && error_check();
+        ((size_t *) p)[-1] ^= 1;
+        test_free(p);
+    } else {
+        p[32] ^= 0xff;
+        test_free(p);
+        caught = error_check();
+    }
+    set_verblevel(saved_verb);
+    return caught;
+}
+
+/* Most threads the alloc command runs its rounds on */
+#define ALLOC_THREADS 16
+
+/* Rounds of the alloc command run by one thread, which ends up holding the
+ * block it kept resizing
+ */
+typedef struct {
+    int reps;
+    unsigned int seed;
+    unsigned char *held;
+    bool ok;
+} alloc_job_t;
+
+/* Run the rounds of job. Only a thread running alone checks after each round
+ * that allocation_check() counts blocks plus the one it holds.
+ */
+static bool alloc_rounds(alloc_job_t *job, bool alone, size_t blocks)
+{
+    unsigned char *p = NULL;
+    size_t len = 0;
+    bool ok = true;
+    for (int r = 0; ok && r < job->reps; r++) {
+        /* Small sizes stay within the pools, larger ones leave them */
+        size_t size = 1 + rand_r(&job->seed) % (r & 1 ? 64 : 4096);
+        unsigned char *np = test_realloc(p, size);
+        if (np) {
+            for (size_t i = 0; ok && i < len && i < size; i++) {
+                if (np[i] != (unsigned char) i) {
+                    report(1,
+                           "ERROR: Byte %zu lost when resizing %zu bytes to "
+                           "%zu",
+                           i, len, size);
+                    ok = false;
+                }
+            }
+            for (size_t i = 0; i < size; i++)
+                np[i] = i;
+            p = np;
+            len = size;
+        }
+
+        size_t align = (size_t) 1 << (r % 13);
+        unsigned char *a = test_aligned_alloc(align, size);
+        unsigned char *na = a ? test_realloc(a, 2 * size) : NULL;
+        if (na)
+            a = na;
+        if ((uintptr_t) a & (align - 1)) {
+            report(1, "ERROR: Block %p lost its alignment to %zu", a, align);
+            ok = false;
+        }
+        test_free(a);
+
+        if (alone && allocation_check() != blocks + !!p) {
+            report(1, "ERROR: %zu blocks allocated, but %zu expected",
+                   allocation_check(), blocks + !!p);
+            ok = false;
+        }
+        ok = ok && (!alone || !error_check());
+    }
+    job->held = p;
+    return ok;
+}
+
+static void *alloc_worker(void *arg)
+{
+    alloc_job_t *job = arg;
+    job->ok = alloc_rounds(job, false, 0);
+    return NULL;
+}
+
+/* Write to a poisoned block once freed and check that the harness notices
+ * before handing its memory out again: a large block once it leaves the
+ * quarantine, an arena block once its arena reuses it
+ */
+static bool alloc_late_write(bool arena)
+{
+    int saved_fail = fail_probability, saved_poison = poison_rate;
+    int saved_verb = verblevel;
+    fail_probability = 0;
+    poison_rate = 1;
+    set_verblevel(0);
+    bool caught = false;
+    if (arena) {
+        test_arena_t *a = test_arena_new();
+        unsigned char *p = a ? test_arena_alloc(a, 64) : NULL;
+        if (p) {
+            test_arena_free(p);
+            p[63] ^= 0xff;
+            test_arena_free(test_arena_alloc(a, 64));
+            caught = error_check();
+        }
+        if (a)
+            test_arena_destroy(a, 0);
+    } else {
+        unsigned char *p = test_malloc(4096);
+        if (p) {
+            test_free(p);
+            p[4095] ^= 0xff;
+            /* Small blocks go through the same quarantine and push it out */
+            for (int i = 0; i < (1 << 16) && !caught; i++) {
+                test_free(test_malloc(16));
+                caught = error_check();
+            }
+        }
+    }
+    set_verblevel(saved_verb);
+    poison_rate = saved_poison;
+    fail_probability = saved_fail;
+    return caught;
+}
+
+/* Run every job, the first one in this thread and the others in workers.
+ * As in run_parallel(), SIGALRM is held off until the workers are joined, so
+ * that running out of time never leaves them running. A timeout then unwinds
+ * from within this call, which must not be inlined: exception_setup() can only
+ * return a second time through the frame of a call made right after it.
+ */
+static __attribute__((noinline)) bool alloc_threads(alloc_job_t *job,
+                                                    int nthreads,
+                                                    size_t blocks)
+{
+    pthread_t tid[ALLOC_THREADS];
+    bool spawned[ALLOC_THREADS] = {false};
+    sigset_t alarm, all, held, old;
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm, &held);
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (int t = 1; t < nthreads; t++)
+        spawned[t] = !pthread_create(&tid[t], NULL, alloc_worker, &job[t]);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    bool ok = alloc_rounds(&job[0], nthreads == 1, blocks);
+
+    /* Joined workers have run their exit handlers, so the blocks they still
+     * counted were handed over with their caches. Freeing what they held
+     * from this thread then has to bring the count back to where it was.
+     */
+    for (int t = 1; t < nthreads; t++) {
+        if (spawned[t])
+            pthread_join(tid[t], NULL);
+        else
+            alloc_worker(&job[t]);
+        ok = ok && job[t].ok;
+    }
+    pthread_sigmask(SIG_SETMASK, &held, NULL);
+    return ok;
+}
+
+static bool do_alloc(int argc, char *argv[])
+{
+    if (argc != 1 && argc != 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    int reps = 1000;
+    if (argc == 2 && (!get_int(argv[1], &reps) || reps < 0)) {
+        report(1, "Invalid number of rounds '%s'", argv[1]);
+        return false;
+    }
+
+    int nthreads = q_threads < ALLOC_THREADS ? q_threads : ALLOC_THREADS;
+    if (nthreads < 1)
+        nthreads = 1;
+    alloc_job_t job[ALLOC_THREADS];
+    for (int t = 0; t < nthreads; t++)
+        job[t] = (alloc_job_t){.reps = reps, .seed = rand(), .ok = true};
+
+    size_t blocks = allocation_check();
+    bool ok = false;
+    error_check();
+
+    if (exception_setup(true))
+        ok = alloc_threads(job, nthreads, blocks);
+    exception_cancel();
+    for (int t = 0; t < nthreads; t++)
+        test_free(job[t].held);
+
+    if (ok && !alloc_damaged(false)) {
+        report(1, "ERROR: Damaged footer went unnoticed");
+        ok = false;
+    }
+    if (ok && !alloc_damaged(true)) {
+        report(1, "ERROR: Damaged header went unnoticed");
+        ok = false;
+    }
+    if (ok && !alloc_late_write(false)) {
+        report(1, "ERROR: Write to a freed large block went unnoticed");
+        ok = false;
+    }
+    if (ok && !alloc_late_write(true)) {
+        report(1, "ERROR: Write to a freed arena block went unnoticed");
+        ok = false;
+    }
+    if (ok && allocation_check() != blocks) {
+        report(1, "ERROR: %zu blocks allocated, but %zu expected",
+               allocation_check(), blocks);
+        ok = false;
+    }
+    if (ok)
+        report(2, "Allocator passed %d rounds on %d threads", reps, nthreads);
+    return ok && !error_check();
+}
+
 static bool do_swap(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -714,7 +1444,7 @@ static bool do_ascend(int argc, char *argv[])
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (strcmp(item->value, next_item->value) > 0) {
+            if (q_strcmp(element_value(item), element_value(next_item)) > 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
                 ok = false;
@@ -761,7 +1491,7 @@ static bool do_descend(int argc, char *argv[])
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (strcmp(item->value, next_item->value) < 0) {
+            if (q_strcmp(element_value(item), element_value(next_item)) < 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
                 ok = false;
@@ -824,7 +1554,11 @@ static bool do_merge(int argc, char *argv[])
     exception_cancel();
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    for (int i = 0; i < q_merge_stats.levels; i++)
+        report(2, "Merge level %d: %d queues in %.3f seconds", i,
+               q_merge_stats.runs[i], q_merge_stats.seconds[i]);
+
+    if (chain.size > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
@@ -849,7 +1583,8 @@ static bool do_merge(int argc, char *argv[])
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (!descend && strcmp(item->value, next_item->value) > 0) {
+            if (!descend &&
+                q_strcmp(element_value(item), element_value(next_item)) > 0) {
                 report(1,
                        "ERROR: Not sorted in ascending order (It might because "
                        "of unsorted queues are merged or there're some flaws "
@@ -859,7 +1594,8 @@ static bool do_merge(int argc, char *argv[])
             }
 
 
-            if (descend && strcmp(item->value, next_item->value) < 0) {
+            if (descend &&
+                q_strcmp(element_value(item), element_value(next_item)) < 0) {
                 report(
                     1,
                     "ERROR: Not sorted in descending order (It might because "
@@ -905,7 +1641,13 @@ static bool q_show(int vlevel)
         return true;
     }
 
-    if (!is_circular()) {
+    /* A ring leaves the list of a non-empty queue empty. Its elements are
+     * read through q_get(), since linking them would turn the queue into a
+     * list for good.
+     */
+    int size = q_size(current->q);
+    bool ring = size && list_empty(current->q);
+    if (!ring && !is_circular()) {
         report(vlevel, "ERROR:  Queue is not doubly circular");
         return false;
     }
@@ -916,18 +1658,22 @@ static bool q_show(int vlevel)
     struct list_head *cur = current->q->next;
 
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < current->size) {
-            element_t *e = list_entry(cur, element_t, list);
+        while (ok && (ring ? cnt < size : ori != cur) &&
+               cnt < current->size) {
+            element_t *e = ring ? q_get(current->q, cnt)
+                                : list_entry(cur, element_t, list);
             if (cnt < BIG_LIST_SIZE) {
-                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
+                report_noreturn(vlevel, cnt == 0 ? "%s" : " %s",
+                                element_value(e));
                 if (show_entropy) {
                     report_noreturn(
                         vlevel, "(%3.2f%%)",
-                        shannon_entropy((const uint8_t *) e->value));
+                        shannon_entropy((const uint8_t *) element_value(e)));
                 }
             }
             cnt++;
-            cur = cur->next;
+            if (!ring)
+                cur = cur->next;
             ok = ok && !error_check();
         }
     }
@@ -938,7 +1684,7 @@ static bool q_show(int vlevel)
         return false;
     }
 
-    if (cur == ori) {
+    if (ring ? cnt == size : cur == ori) {
         if (cnt <= BIG_LIST_SIZE)
             report(vlevel, "]");
         else
@@ -1028,20 +1774,41 @@ static void console_init()
                 "str [n]");
     ADD_COMMAND(
         rh,
-        "Remove from head of queue. Optionally compare to expected value str",
-        "[str]");
+        "Remove from head of queue n times. Optionally compare to expected "
+        "value str, except RAND with n (default: n == 1)",
+        "[str [n]]");
     ADD_COMMAND(
         rt,
-        "Remove from tail of queue. Optionally compare to expected value str",
-        "[str]");
+        "Remove from tail of queue n times. Optionally compare to expected "
+        "value str, except RAND with n (default: n == 1)",
+        "[str [n]]");
     ADD_COMMAND(reverse, "Reverse queue", "");
     ADD_COMMAND(sort, "Sort queue in ascending/descening order", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
-    ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
+    ADD_COMMAND(get,
+                "Get node at position i of queue. Optionally compare to "
+                "expected value str",
+                "i [str]");
+    ADD_COMMAND(delete, "Delete node at position i of queue", "i");
+    ADD_COMMAND(find, "Look up a node of queue by its string", "str");
+    ADD_COMMAND(del, "Delete a node of queue by its string", "str");
+    ADD_COMMAND(split,
+                "Split queue at position i, moving the nodes from i on to a "
+                "new queue",
+                "i");
+    ADD_COMMAND(dedup,
+                "Delete all nodes that have duplicate string. With 'unsorted', "
+                "the queue does not need to be sorted",
+                "[unsorted]");
     ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
     ADD_COMMAND(swap, "Swap every two adjacent nodes in queue", "");
+    ADD_COMMAND(alloc,
+                "Resize and align blocks through the harness n times on each "
+                "of the threads, then check that damaged blocks are caught "
+                "(default: n == 1000)",
+                "[n]");
     ADD_COMMAND(ascend,
                 "Remove every node which has a node with a strictly less "
                 "value anywhere to the right side of it",
@@ -1056,10 +1823,33 @@ static void console_init()
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
               NULL);
+    add_param("poison", &poison_rate,
+              "Fill 1 in N allocated and freed payloads, 0 for headers only",
+              NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("threads", &q_threads, "Number of threads used by sort and merge",
+              NULL);
+    add_param("sortalgo", &q_sort_algo,
+              "Sort engine: 0 for merge sort, 1 for radix sort", NULL);
+    add_param("copy", &remove_copy,
+              "Removal by rh/rt: 1 copies the string out, 0 takes the element "
+              "and reads it in place",
+              NULL);
+    /* Byte order through a function pointer, to gauge the generic path */
+    q_compare_fn = strcmp;
+    add_param("compare", &q_compare,
+              "Ordering of sort, merge, ascend and descend: 0 for strcmp, 1 "
+              "for natural, 2 for case-insensitive, 3 for length first, 4 "
+              "for strcmp called through a pointer",
+              NULL);
+    add_param("backend", &q_backend,
+              "Layout of new queues: 0 for linked list, 1 for unrolled list, "
+              "2 for ring buffer. Simulation measures dm on a linked list "
+              "whatever the layout",
+              NULL);
 }
 
 /* Signal handlers */
@@ -1092,8 +1882,6 @@ static void q_init()
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1107,7 +1895,6 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
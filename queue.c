@@ -1,6 +1,12 @@
+#include <pthread.h>
+#include <assert.h>
+#include <ctype.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h> /* strcasecmp */
+#include <time.h>
 
 #include "queue.h"
 
@@ -10,142 +16,1466 @@
  *   cppcheck-suppress nullPointer
  */
 
+/* Upper bound of q_threads, which sizes the per-thread workspace on stack */
+#define MAX_THREADS 64
 
-/* Create an empty queue */
-struct list_head *q_new()
+/* Queues shorter than this are always sorted by a single thread */
+#define PARALLEL_SORT_MIN (1 << 14)
+
+/* Chains holding fewer elements than this are always merged serially */
+#define PARALLEL_MERGE_MIN (1 << 14)
+
+/* Buckets smaller than this are finished by insertion sort */
+#define RADIX_SORT_MIN 32
+
+/* Distribution stops after this many bytes of common prefix */
+#define RADIX_MAX_DEPTH 64
+
+/* Entries per chunk of an unrolled queue, which keeps a chunk within the
+ * largest size class of the arena
+ */
+#define CHUNK_ITEMS 28
+
+/* Empty chunks an unrolled queue keeps aside. Merging two sorted runs of
+ * chunks never has more than two output chunks in use beyond those freed
+ * from its inputs, so two spares let q_sort() run without allocating.
+ */
+#define CHUNK_SPARES 2
+
+/* Capacity of the ring of a ring-buffer queue when it is first allocated */
+#define RING_MIN 16
+
+int q_threads = 1;
+int q_sort_algo = SORT_MERGE;
+int q_backend = QUEUE_LINKED;
+int q_compare = COMPARE_STRCMP;
+int (*q_compare_fn)(const char *a, const char *b);
+merge_stats_t q_merge_stats;
+
+/* Recover the queue header from the list head handed out by q_new() */
+static inline queue_t *q_header(struct list_head *head)
 {
-    struct list_head *q = malloc(sizeof(struct list_head));
-    if (!q)
+    return container_of(head, queue_t, head);
+}
+
+/* Positional index over the nodes of a queue. slot[first..count] holds the
+ * nodes in list order, NULL for those deleted since the index was built, and
+ * the tree fields form a Fenwick tree counting the nodes still linked, so that
+ * the node at any position is found in O(log n) steps. The empty slots before
+ * first and after count take the nodes inserted at either end.
+ */
+struct q_index {
+    bool valid;
+    int cap;
+    int first;
+    int count;
+    struct {
+        struct list_head *node;
+        int tree;
+    } slot[];
+};
+
+/* Index of the values of a queue with open addressing and linear probing.
+ * slot[] holds the nodes of the elements, NULL when empty, and is kept at most
+ * half full. Each element caches the hash of its string, see element_t.
+ */
+struct q_hash {
+    bool valid;
+    unsigned int mask;
+    int count;
+    struct list_head *slot[];
+};
+
+/* 64-bit FNV-1a hash of a string */
+static uint64_t str_hash(const char *s)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Have the next lookup by value rebuild the index */
+static inline void hash_invalidate(queue_t *q)
+{
+    if (q->hash)
+        q->hash->valid = false;
+}
+
+static inline element_t *hash_entry(struct list_head *node)
+{
+    return list_entry(node, element_t, list);
+}
+
+/* Allocate an empty index with room for at least n values */
+static struct q_hash *hash_alloc(int n)
+{
+    size_t cap = 16;
+    while (cap < (size_t) n * 2)
+        cap <<= 1;
+    struct q_hash *hash =
+        malloc(sizeof(struct q_hash) + cap * sizeof(struct list_head *));
+    if (!hash)
         return NULL;
-    INIT_LIST_HEAD(q);
-    return q;
+    hash->valid = true;
+    hash->mask = cap - 1;
+    hash->count = 0;
+    memset(hash->slot, 0, cap * sizeof(struct list_head *));
+    return hash;
 }
 
-/* Free all storage used by queue */
-void q_free(struct list_head *head)
+static void hash_put(struct q_hash *hash, element_t *e)
 {
-    if (!head)
+    unsigned int i = e->hash & hash->mask;
+    while (hash->slot[i])
+        i = (i + 1) & hash->mask;
+    hash->slot[i] = &e->list;
+    hash->count++;
+}
+
+/* Enter a new element of q into its index, if that is in use */
+static void hash_add(queue_t *q, element_t *e)
+{
+    struct q_hash *hash = q->hash;
+    if (!hash || !hash->valid)
+        return;
+    if ((size_t) (hash->count + 1) * 2 > (size_t) hash->mask + 1) {
+        struct q_hash *grown = hash_alloc(hash->count + 1);
+        if (!grown) {
+            hash->valid = false;
+            return;
+        }
+        for (unsigned int i = 0; i <= hash->mask; i++)
+            if (hash->slot[i])
+                hash_put(grown, hash_entry(hash->slot[i]));
+        free(hash);
+        q->hash = hash = grown;
+    }
+    e->hash = str_hash(element_value(e)) >> 32;
+    hash_put(hash, e);
+}
+
+/* Take an element leaving q out of its index, if that is in use, shifting
+ * back the entries after it that would otherwise become unreachable
+ */
+static void hash_del(queue_t *q, element_t *e)
+{
+    struct q_hash *hash = q->hash;
+    if (!hash || !hash->valid)
+        return;
+    unsigned int mask = hash->mask, i = e->hash & mask;
+    while (hash->slot[i] != &e->list)
+        i = (i + 1) & mask;
+    for (unsigned int j = (i + 1) & mask; hash->slot[j]; j = (j + 1) & mask) {
+        unsigned int home = hash_entry(hash->slot[j])->hash & mask;
+        /* The entry at j may fill the hole unless it hashes within (i, j] */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            hash->slot[i] = hash->slot[j];
+            i = j;
+        }
+    }
+    hash->slot[i] = NULL;
+    hash->count--;
+}
+
+/* Have the next positional access rebuild the index */
+static inline void index_invalidate(queue_t *q)
+{
+    if (q->index)
+        q->index->valid = false;
+}
+
+/* Forget where the nodes are after they were relinked */
+static inline void q_relinked(queue_t *q)
+{
+    q->mid = NULL;
+    index_invalidate(q);
+    q->chunks.valid = false;
+}
+
+/* Return the index of q, rebuilding it if it is stale */
+static struct q_index *q_index(queue_t *q)
+{
+    struct q_index *idx = q->index;
+    if (idx && idx->valid)
+        return idx;
+    if (!idx || idx->cap < q->size + q->size / 4) {
+        int cap = q->size + q->size / 2 > 16 ? q->size + q->size / 2 : 16;
+        idx = malloc(sizeof(struct q_index) + (cap + 1) * sizeof(idx->slot[0]));
+        if (!idx)
+            return NULL;
+        idx->cap = cap;
+        free(q->index);
+        q->index = idx;
+    }
+
+    /* Half the room left goes before the nodes, for those inserted at head */
+    int k = 0;
+    idx->first = (idx->cap - q->size) / 2 + 1;
+    while (k < idx->first - 1) {
+        idx->slot[++k].node = NULL;
+        idx->slot[k].tree = 0;
+    }
+    struct list_head *node;
+    list_for_each (node, &q->head) {
+        idx->slot[++k].node = node;
+        idx->slot[k].tree = 1;
+    }
+    idx->count = k;
+    for (k = 1; k <= idx->count; k++) {
+        int parent = k + (k & -k);
+        if (parent <= idx->count)
+            idx->slot[parent].tree += idx->slot[k].tree;
+    }
+    idx->valid = true;
+    return idx;
+}
+
+/* Return the slot of the node at position i, which must be in range */
+static int index_find(struct q_index *idx, int i)
+{
+    int k = 0;
+    for (int step = 1 << (31 - __builtin_clz(idx->count)); step; step >>= 1) {
+        if (k + step <= idx->count && idx->slot[k + step].tree <= i) {
+            k += step;
+            i -= idx->slot[k].tree;
+        }
+    }
+    return k + 1;
+}
+
+/* Enter the k nodes just linked at the front or back of q in its index. node
+ * is the one next to the previous end, and the others follow away from it.
+ */
+static void index_add(queue_t *q, struct list_head *node, int k, bool front)
+{
+    struct q_index *idx = q->index;
+    if (!idx || !idx->valid)
+        return;
+    if (front ? idx->first <= k : idx->cap - idx->count < k) {
+        idx->valid = false;
+        return;
+    }
+    for (; k--; node = front ? node->prev : node->next) {
+        int j;
+        if (front) {
+            /* The slots before first count nothing, so the new slot only
+             * adds one to itself and the slots covering it
+             */
+            j = --idx->first;
+            idx->slot[j].node = node;
+            for (int up = j; up <= idx->count; up += up & -up)
+                idx->slot[up].tree++;
+        } else {
+            j = ++idx->count;
+            idx->slot[j].node = node;
+            idx->slot[j].tree = 1;
+            for (int down = j - 1; down > j - (j & -j); down -= down & -down)
+                idx->slot[j].tree += idx->slot[down].tree;
+        }
+    }
+}
+
+/* Take the k nodes about to be unlinked from the front or back of q out of
+ * its index. Those at the back go by cutting the tree short, while those at
+ * the front leave their slots empty for later insertions at head.
+ */
+static void index_del(queue_t *q, int k, bool front)
+{
+    struct q_index *idx = q->index;
+    if (!idx || !idx->valid)
         return;
-    element_t *entry, *safe;
-    list_for_each_entry_safe (entry, safe, head, list) {
-        q_release_element(entry);
+    if (k == q->size) {
+        idx->count = idx->first - 1;
+    } else if (!front) {
+        idx->count = index_find(idx, q->size - k - 1);
+    } else if (2 * k > q->size) {
+        idx->valid = false;
+    } else {
+        while (k--) {
+            int j = index_find(idx, 0);
+            idx->slot[j].node = NULL;
+            idx->first = j + 1;
+            for (; j <= idx->count; j += j & -j)
+                idx->slot[j].tree--;
+        }
     }
-    free(head);
 }
 
-static element_t *new_element(char *s)
+/* Pack the first 8 bytes of s, zero-padded, with s[0] as the top byte */
+static inline uint64_t key_prefix(const char *s)
 {
-    char *t = strdup(s);
-    if (!t)
+    uint64_t prefix = 0;
+    for (int i = 0; i < 8; i++) {
+        prefix <<= 8;
+        if (*s)
+            prefix |= (unsigned char) *s++;
+    }
+    return prefix;
+}
+
+/* Compare two elements like strcmp() does on their values, looking at the
+ * cached prefixes first and at the strings only when those are equal
+ */
+static inline int element_cmp(element_t *a, element_t *b)
+{
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix ? -1 : 1;
+    /* Equal prefixes that end in a null byte mean equal strings */
+    if (!(a->prefix & 0xff))
+        return 0;
+    return strcmp(element_value(a) + 8, element_value(b) + 8);
+}
+
+/* Compare a and b as strcmp() does, except that two runs of digits compare by
+ * their numeric value and leading zeros are ignored, so "a9" < "a10" = "a010"
+ */
+static int natural_strcmp(const char *a, const char *b)
+{
+    while (*a && *b) {
+        if (!isdigit((unsigned char) *a) || !isdigit((unsigned char) *b)) {
+            if (*a != *b)
+                return (unsigned char) *a < (unsigned char) *b ? -1 : 1;
+            a++, b++;
+            continue;
+        }
+        while (*a == '0')
+            a++;
+        while (*b == '0')
+            b++;
+        size_t la = 0, lb = 0;
+        while (isdigit((unsigned char) a[la]))
+            la++;
+        while (isdigit((unsigned char) b[lb]))
+            lb++;
+        if (la != lb)
+            return la < lb ? -1 : 1;
+        int cmp = memcmp(a, b, la);
+        if (cmp)
+            return cmp;
+        a += la, b += lb;
+    }
+    return !!*a - !!*b;
+}
+
+/* Compare strings in the ordering selected by q_compare */
+int q_strcmp(const char *a, const char *b)
+{
+    switch (q_compare) {
+    case COMPARE_NATURAL:
+        return natural_strcmp(a, b);
+    case COMPARE_NOCASE:
+        return strcasecmp(a, b);
+    case COMPARE_LENGTH: {
+        size_t la = strlen(a), lb = strlen(b);
+        if (la != lb)
+            return la < lb ? -1 : 1;
+        return strcmp(a, b);
+    }
+    case COMPARE_CUSTOM:
+        if (q_compare_fn)
+            return q_compare_fn(a, b);
+        return strcmp(a, b);
+    default:
+        return strcmp(a, b);
+    }
+}
+
+/* Entry of a chunk, with the sort key prefix next to the element */
+typedef struct {
+    uint64_t prefix;
+    element_t *element;
+} chunk_item_t;
+
+/* Array of consecutive elements of an unrolled queue, item[begin..end) */
+typedef struct {
+    struct list_head link;
+    int begin, end;
+    chunk_item_t item[CHUNK_ITEMS];
+} chunk_t;
+
+/* element_cmp() on chunk entries, which reads the elements only on ties */
+static inline int item_cmp(const chunk_item_t *a, const chunk_item_t *b)
+{
+    if (a->prefix != b->prefix)
+        return a->prefix < b->prefix ? -1 : 1;
+    if (!(a->prefix & 0xff))
+        return 0;
+    return strcmp(element_value(a->element) + 8,
+                  element_value(b->element) + 8);
+}
+
+/* Take a spare chunk of q if it has more than keep of them, or allocate one */
+static chunk_t *chunk_get(queue_t *q, int keep)
+{
+    chunk_t *c;
+    if (q->chunks.nspare > keep) {
+        c = list_first_entry(&q->chunks.spare, chunk_t, link);
+        list_del(&c->link);
+        q->chunks.nspare--;
+    } else {
+        c = test_arena_alloc(q->arena, sizeof(chunk_t));
+        if (!c)
+            return NULL;
+    }
+    c->begin = c->end = 0;
+    return c;
+}
+
+/* Unlink chunk c from where it is and keep it as a spare */
+static inline void chunk_put(queue_t *q, chunk_t *c)
+{
+    list_move(&c->link, &q->chunks.spare);
+    q->chunks.nspare++;
+}
+
+/* Unlink an emptied chunk, keeping it only if spares are missing */
+static void chunk_drop(queue_t *q, chunk_t *c)
+{
+    if (q->chunks.nspare < CHUNK_SPARES) {
+        chunk_put(q, c);
+    } else {
+        list_del(&c->link);
+        test_arena_free(c);
+    }
+}
+
+/* Lay the elements of an unrolled queue out in its chunks again after they
+ * were relinked, reusing the chunks it already has
+ */
+static bool chunks_sync(queue_t *q)
+{
+    chunk_t *c, *safe;
+    list_for_each_entry_safe (c, safe, &q->chunks.used, link)
+        chunk_put(q, c);
+
+    c = NULL;
+    element_t *element;
+    list_for_each_entry (element, &q->head, list) {
+        if (!c || c->end == CHUNK_ITEMS) {
+            c = chunk_get(q, 0);
+            if (!c)
+                return false;
+            list_add_tail(&c->link, &q->chunks.used);
+        }
+        c->item[c->end++] = (chunk_item_t){element->prefix, element};
+    }
+
+    while (q->chunks.nspare < CHUNK_SPARES) {
+        c = test_arena_alloc(q->arena, sizeof(chunk_t));
+        if (!c)
+            return false;
+        list_add(&c->link, &q->chunks.spare);
+        q->chunks.nspare++;
+    }
+    while (q->chunks.nspare > CHUNK_SPARES) {
+        c = list_first_entry(&q->chunks.spare, chunk_t, link);
+        q->chunks.nspare--;
+        list_del(&c->link);
+        test_arena_free(c);
+    }
+    q->chunks.valid = true;
+    return true;
+}
+
+/* Return a chunk with room for one more entry at the front or back of q */
+static chunk_t *chunk_room(queue_t *q, bool front)
+{
+    struct list_head *end = front ? q->chunks.used.next : q->chunks.used.prev;
+    if (end != &q->chunks.used) {
+        chunk_t *c = list_entry(end, chunk_t, link);
+        if (c->begin == c->end)
+            c->begin = c->end = front ? CHUNK_ITEMS : 0;
+        if (front ? c->begin > 0 : c->end < CHUNK_ITEMS)
+            return c;
+    }
+
+    chunk_t *c = chunk_get(q, CHUNK_SPARES);
+    if (!c)
         return NULL;
-    element_t *element = malloc(sizeof(element_t));
-    if (!element) {
-        free(t);
+    if (front) {
+        c->begin = c->end = CHUNK_ITEMS;
+        list_add(&c->link, &q->chunks.used);
+    } else {
+        list_add_tail(&c->link, &q->chunks.used);
+    }
+    return c;
+}
+
+/* Return the chunk holding the first or last entry of a non-empty unrolled
+ * queue, dropping the empty chunks in the way
+ */
+static chunk_t *chunk_end(queue_t *q, bool front)
+{
+    for (;;) {
+        chunk_t *c = front ? list_first_entry(&q->chunks.used, chunk_t, link)
+                           : list_last_entry(&q->chunks.used, chunk_t, link);
+        if (c->begin != c->end)
+            return c;
+        chunk_drop(q, c);
+    }
+}
+
+/* Return the chunk holding the entry at position *i of an unrolled queue,
+ * which must be in range, and turn *i into its slot in that chunk. The walk
+ * starts from the nearer end and steps over whole chunks.
+ */
+static chunk_t *chunk_at(queue_t *q, int *i)
+{
+    chunk_t *c;
+    if (*i < q->size / 2) {
+        int k = *i;
+        list_for_each_entry (c, &q->chunks.used, link) {
+            if (k < c->end - c->begin) {
+                *i = c->begin + k;
+                return c;
+            }
+            k -= c->end - c->begin;
+        }
+    } else {
+        int k = q->size - 1 - *i;
+        struct list_head *node;
+        for (node = q->chunks.used.prev; node != &q->chunks.used;
+             node = node->prev) {
+            c = list_entry(node, chunk_t, link);
+            if (k < c->end - c->begin) {
+                *i = c->end - 1 - k;
+                return c;
+            }
+            k -= c->end - c->begin;
+        }
+    }
+    return NULL;
+}
+
+/* Return the chunk holding the entry of element and turn *i into its slot */
+static chunk_t *chunk_of(queue_t *q, const element_t *element, int *i)
+{
+    chunk_t *c;
+    list_for_each_entry (c, &q->chunks.used, link) {
+        for (int k = c->begin; k < c->end; k++) {
+            if (c->item[k].element == element) {
+                *i = k;
+                return c;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Remove slot k of chunk c, closing the gap from the shorter side */
+static void chunk_erase(queue_t *q, chunk_t *c, int k)
+{
+    if (k - c->begin < c->end - 1 - k) {
+        memmove(&c->item[c->begin + 1], &c->item[c->begin],
+                (k - c->begin) * sizeof(c->item[0]));
+        c->begin++;
+    } else {
+        memmove(&c->item[k], &c->item[k + 1],
+                (c->end - 1 - k) * sizeof(c->item[0]));
+        c->end--;
+    }
+    if (c->begin == c->end)
+        chunk_drop(q, c);
+}
+
+/* Thread the elements of an unrolled queue through its list in chunk order */
+static void chunks_relink(queue_t *q)
+{
+    INIT_LIST_HEAD(&q->head);
+    chunk_t *c;
+    list_for_each_entry (c, &q->chunks.used, link) {
+        for (int i = c->begin; i < c->end; i++)
+            list_add_tail(&c->item[i].element->list, &q->head);
+    }
+}
+
+static element_t *new_element(struct list_head *head, char *s)
+{
+    test_arena_t *arena = q_header(head)->arena;
+    size_t len = strlen(s) + 1;
+    /* A long string follows the element in the same block */
+    size_t extra = len > ELEMENT_INLINE_SIZE ? len : 0;
+    element_t *element = test_arena_alloc(arena, sizeof(element_t) + extra);
+    if (!element)
         return NULL;
+    element->is_inline = !extra;
+    if (extra)
+        element->value.ptr = (char *) (element + 1);
+    memcpy(element_value(element), s, len);
+    element->prefix = key_prefix(s);
+    return element;
+}
+
+/* Return the element at index i of the ring of q */
+static inline element_t *ring_at(const queue_t *q, int i)
+{
+    unsigned int pos = q->ring.head + i;
+    if (pos - q->ring.lo < q->ring.hi - q->ring.lo)
+        return q->ring.old[pos & (q->ring.mask >> 1)];
+    return q->ring.slot[pos & q->ring.mask];
+}
+
+/* Move up to n elements of q out of the array its ring outgrew */
+static void ring_migrate(queue_t *q, unsigned int n)
+{
+    unsigned int half = q->ring.mask >> 1;
+    for (; n && q->ring.lo != q->ring.hi; n--, q->ring.lo++)
+        q->ring.slot[q->ring.lo & q->ring.mask] =
+            q->ring.old[q->ring.lo & half];
+    if (q->ring.old && q->ring.lo == q->ring.hi) {
+        test_arena_free(q->ring.old);
+        q->ring.old = NULL;
     }
-    element->value = t;
+}
+
+/* Make room in the ring of q for one more element. A full ring moves to an
+ * array twice its size, keeping the positions of its elements, and leaves
+ * them in the old array. Each insertion then moves one of them over: the old
+ * array starts with as many elements as the new one has free slots, so it is
+ * empty by the time the new one is full.
+ */
+static bool ring_reserve(queue_t *q)
+{
+    if (!q->ring.slot || (unsigned int) q->size > q->ring.mask) {
+        unsigned int cap = q->ring.slot ? (q->ring.mask + 1) * 2 : RING_MIN;
+        element_t **slot =
+            test_arena_alloc(q->arena, cap * sizeof(element_t *));
+        if (!slot)
+            return false;
+        q->ring.old = q->ring.slot;
+        q->ring.slot = slot;
+        q->ring.mask = cap - 1;
+        q->ring.lo = q->ring.head;
+        q->ring.hi = q->ring.head + q->size;
+    }
+    ring_migrate(q, 1);
+    return true;
+}
+
+static bool ring_insert(queue_t *q, char *s, bool front)
+{
+    if (!ring_reserve(q))
+        return false;
+    element_t *element = new_element(&q->head, s);
+    if (!element)
+        return false;
+    /* Either end lies outside the positions left in the old array */
+    if (front)
+        q->ring.head--;
+    q->ring.slot[(q->ring.head + (front ? 0 : q->size)) & q->ring.mask] =
+        element;
+    hash_add(q, element);
+    q->size++;
+    return true;
+}
+
+static element_t *ring_remove(queue_t *q, bool front)
+{
+    element_t *element = ring_at(q, front ? 0 : q->size - 1);
+    /* Shrink the positions left in the old array along with the ring */
+    if (q->ring.lo != q->ring.hi) {
+        if (front && q->ring.lo == q->ring.head)
+            q->ring.lo++;
+        else if (!front && q->ring.hi == q->ring.head + q->size)
+            q->ring.hi--;
+    }
+    if (front)
+        q->ring.head++;
+    q->size--;
     return element;
 }
 
+/* A ring-buffer queue that was linked goes back to its ring once empty */
+static inline void ring_resume(queue_t *q)
+{
+    if (q->backend == QUEUE_RING && !q->ring.active && !q->size) {
+        q_relinked(q);
+        /* An outgrown array has nothing left to move, the insertion frees it */
+        q->ring.lo = q->ring.hi;
+        q->ring.active = true;
+    }
+}
+
+/* Create an empty queue */
+struct list_head *q_new()
+{
+    queue_t *q = malloc(sizeof(queue_t));
+    if (!q)
+        return NULL;
+    q->arena = test_arena_new();
+    if (!q->arena) {
+        free(q);
+        return NULL;
+    }
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    q->mid = NULL;
+    q->index = NULL;
+    q->hash = NULL;
+    q->backend = q_backend;
+    INIT_LIST_HEAD(&q->chunks.used);
+    INIT_LIST_HEAD(&q->chunks.spare);
+    q->chunks.nspare = 0;
+    q->chunks.valid = false;
+    if (q->backend == QUEUE_UNROLLED)
+        chunks_sync(q);
+    q->ring.slot = q->ring.old = NULL;
+    q->ring.mask = q->ring.head = q->ring.lo = q->ring.hi = 0;
+    q->ring.active = q->backend == QUEUE_RING;
+    q->ring.parked = NULL;
+    if (q->ring.active)
+        ring_reserve(q);
+    return &q->head;
+}
+
+/* Free all storage used by queue */
+void q_free(struct list_head *head)
+{
+    if (!head)
+        return;
+    queue_t *q = q_header(head);
+    while (q->ring.parked) {
+        void *ring = q->ring.parked;
+        q->ring.parked = *(void **) ring;
+        test_arena_free(ring);
+    }
+    if (test_arena_shared(q->arena)) {
+        q_link(head);
+        test_arena_free(q->ring.slot);
+        test_arena_free(q->ring.old);
+        element_t *element, *safe;
+        list_for_each_entry_safe (element, safe, head, list)
+            q_release_element(element);
+        chunk_t *c, *next;
+        list_splice_init(&q->chunks.spare, &q->chunks.used);
+        list_for_each_entry_safe (c, next, &q->chunks.used, link)
+            test_arena_free(c);
+        INIT_LIST_HEAD(&q->chunks.used);
+        q->chunks.nspare = 0;
+    }
+    /* Whatever the arena holds beyond the blocks still reachable from the
+     * queue has leaked, and stays counted by allocation_check()
+     */
+    size_t blocks =
+        q->size + q->chunks.nspare + !!q->ring.slot + !!q->ring.old;
+    chunk_t *c;
+    list_for_each_entry (c, &q->chunks.used, link)
+        blocks++;
+    test_arena_destroy(q->arena, blocks);
+    free(q->index);
+    free(q->hash);
+    free(q);
+}
+
 /* Insert an element at head of queue */
 bool q_insert_head(struct list_head *head, char *s)
 {
-    element_t *element = new_element(s);
+    if (!head)
+        return false;
+    queue_t *q = q_header(head);
+    ring_resume(q);
+    if (q->ring.active)
+        return ring_insert(q, s, true);
+    if (q->backend == QUEUE_UNROLLED && !q->chunks.valid)
+        chunks_sync(q);
+    chunk_t *c = NULL;
+    if (q->chunks.valid && !(c = chunk_room(q, true)))
+        return false;
+    element_t *element = new_element(head, s);
     if (!element)
         return false;
     list_add(&element->list, head);
+    if (c)
+        c->item[--c->begin] = (chunk_item_t){element->prefix, element};
+    hash_add(q, element);
+    index_add(q, &element->list, 1, true);
+    /* The middle index n / 2 stays put when n goes from odd to even */
+    if (!q->size)
+        q->mid = &element->list;
+    else if (q->mid && !(q->size & 1))
+        q->mid = q->mid->prev;
+    q->size++;
     return true;
 }
 
 /* Insert an element at tail of queue */
 bool q_insert_tail(struct list_head *head, char *s)
 {
-    element_t *element = new_element(s);
+    if (!head)
+        return false;
+    queue_t *q = q_header(head);
+    ring_resume(q);
+    if (q->ring.active)
+        return ring_insert(q, s, false);
+    if (q->backend == QUEUE_UNROLLED && !q->chunks.valid)
+        chunks_sync(q);
+    chunk_t *c = NULL;
+    if (q->chunks.valid && !(c = chunk_room(q, false)))
+        return false;
+    element_t *element = new_element(head, s);
     if (!element)
         return false;
     list_add_tail(&element->list, head);
+    if (c)
+        c->item[c->end++] = (chunk_item_t){element->prefix, element};
+    hash_add(q, element);
+    index_add(q, &element->list, 1, false);
+    if (!q->size)
+        q->mid = &element->list;
+    else if (q->mid && (q->size & 1))
+        q->mid = q->mid->next;
+    q->size++;
     return true;
 }
 
+/* Move the midpoint cursor ahead of unlinking the node at position i */
+static void mid_unlink(queue_t *q, int i)
+{
+    if (q->size == 1)
+        q->mid = NULL;
+    else if (q->mid && (q->size & 1) && i <= q->size / 2)
+        q->mid = q->mid->next;
+    else if (q->mid && !(q->size & 1) && i >= q->size / 2)
+        q->mid = q->mid->prev;
+}
+
+/* Move the middle cursor of q by steps nodes, forward if steps is positive */
+static void mid_shift(queue_t *q, int steps)
+{
+    if (!q->mid)
+        return;
+    for (; steps > 0; steps--)
+        q->mid = q->mid->next;
+    for (; steps < 0; steps++)
+        q->mid = q->mid->prev;
+}
+
+/* Chain up to n new elements apart from q and splice them in at once */
+static int insert_n(queue_t *q, char **s, int n, bool repeat, bool front)
+{
+    int k = 0;
+    ring_resume(q);
+    if (q->ring.active) {
+        /* The ring takes elements one by one anyway */
+        bool (*insert)(struct list_head *, char *) =
+            front ? q_insert_head : q_insert_tail;
+        while (k < n && insert(&q->head, s[repeat ? 0 : k]))
+            k++;
+        return k;
+    }
+    if (q->backend == QUEUE_UNROLLED && !q->chunks.valid)
+        chunks_sync(q);
+
+    /* Chunks are filled in the order the chain is later spliced in */
+    LIST_HEAD(chain);
+    for (; k < n; k++) {
+        chunk_t *c = NULL;
+        if (q->chunks.valid && !(c = chunk_room(q, front)))
+            break;
+        element_t *element = new_element(&q->head, s[repeat ? 0 : k]);
+        if (!element)
+            break;
+        if (c && front)
+            c->item[--c->begin] = (chunk_item_t){element->prefix, element};
+        else if (c)
+            c->item[c->end++] = (chunk_item_t){element->prefix, element};
+        hash_add(q, element);
+        if (front)
+            list_add(&element->list, &chain);
+        else
+            list_add_tail(&element->list, &chain);
+    }
+    if (!k)
+        return 0;
+
+    /* The middle index goes from n / 2 to (n + k) / 2, and an insertion at
+     * head also pushes the old middle node k places further
+     */
+    int n0 = q->size;
+    if (!n0)
+        q->mid = NULL;
+    struct list_head *edge = front ? chain.prev : chain.next;
+    if (front) {
+        list_splice(&chain, &q->head);
+        mid_shift(q, (n0 + k) / 2 - n0 / 2 - k);
+    } else {
+        list_splice_tail(&chain, &q->head);
+        mid_shift(q, (n0 + k) / 2 - n0 / 2);
+    }
+    index_add(q, edge, k, front);
+    q->size += k;
+    return k;
+}
+
+/* Insert several elements at head of queue */
+int q_insert_head_n(struct list_head *head, char **s, int n, bool repeat)
+{
+    if (!head || !s || n <= 0)
+        return 0;
+    return insert_n(q_header(head), s, n, repeat, true);
+}
+
+/* Insert several elements at tail of queue */
+int q_insert_tail_n(struct list_head *head, char **s, int n, bool repeat)
+{
+    if (!head || !s || n <= 0)
+        return 0;
+    return insert_n(q_header(head), s, n, repeat, false);
+}
+
+/* Copy the string of element to sp, writing only up to its terminator, where
+ * strncpy() would pad all of sp with zeros
+ */
+static inline void copy_value(char *sp, size_t bufsize, element_t *element)
+{
+    const char *value = element_value(element);
+    size_t len = strnlen(value, bufsize - 1);
+    memcpy(sp, value, len);
+    sp[len] = 0;
+}
+
 /* Remove an element from head of queue */
 element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || list_empty(head))
+    if (!head || !q_size(head))
         return NULL;
-    element_t *element = container_of(head->next, element_t, list);
-    list_del(&element->list);
-    if (element->value && sp) {
-        strncpy(sp, element->value, bufsize - 1);
-        sp[bufsize - 1] = 0;
+    queue_t *q = q_header(head);
+    element_t *element;
+    if (q->ring.active) {
+        element = ring_remove(q, true);
+    } else {
+        element = container_of(head->next, element_t, list);
+        mid_unlink(q, 0);
+        index_del(q, 1, true);
+        if (q->chunks.valid) {
+            chunk_t *c = chunk_end(q, true);
+            if (++c->begin == c->end)
+                chunk_drop(q, c);
+        }
+        list_del(&element->list);
+        q->size--;
     }
+    hash_del(q, element);
+    if (sp)
+        copy_value(sp, bufsize, element);
     return element;
 }
 
 /* Remove an element from tail of queue */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
 {
-    if (!head || list_empty(head))
+    if (!head || !q_size(head))
         return NULL;
-    element_t *element = container_of(head->prev, element_t, list);
-    list_del(&element->list);
-    if (element->value && sp) {
-        strncpy(sp, element->value, bufsize - 1);
-        sp[bufsize - 1] = 0;
+    queue_t *q = q_header(head);
+    element_t *element;
+    if (q->ring.active) {
+        element = ring_remove(q, false);
+    } else {
+        element = container_of(head->prev, element_t, list);
+        mid_unlink(q, q->size - 1);
+        index_del(q, 1, false);
+        if (q->chunks.valid) {
+            chunk_t *c = chunk_end(q, false);
+            if (--c->end == c->begin)
+                chunk_drop(q, c);
+        }
+        list_del(&element->list);
+        q->size--;
     }
+    hash_del(q, element);
+    if (sp)
+        copy_value(sp, bufsize, element);
     return element;
 }
 
+/* Copy the string of element to buf + *used, unless it does not fit */
+static bool pack_value(element_t *element,
+                       char *buf,
+                       size_t bufsize,
+                       size_t *offsets,
+                       int i,
+                       size_t *used)
+{
+    if (!buf)
+        return true;
+    const char *value = element_value(element);
+    size_t len = strlen(value) + 1;
+    if (len > bufsize - *used)
+        return false;
+    memcpy(buf + *used, value, len);
+    if (offsets)
+        offsets[i] = *used;
+    *used += len;
+    return true;
+}
+
+/* Cut up to n elements off one end of q in a single step and release them */
+static int remove_n(queue_t *q,
+                    int n,
+                    char *buf,
+                    size_t bufsize,
+                    size_t *offsets,
+                    bool front)
+{
+    struct list_head *head = &q->head;
+    size_t used = 0;
+    int k = 0;
+    if (q->ring.active || q->chunks.valid) {
+        /* The ring and the chunks give elements back one by one anyway */
+        for (; k < n && q->size; k++) {
+            element_t *element = front ? q_peek_head(head) : q_peek_tail(head);
+            if (!pack_value(element, buf, bufsize, offsets, k, &used))
+                break;
+            q_release_element(front ? q_remove_head(head, NULL, 0)
+                                    : q_remove_tail(head, NULL, 0));
+        }
+        return k;
+    }
+
+    /* Walk to the last node to remove, copying strings along the way */
+    struct list_head *node = head;
+    for (; k < n && k < q->size; k++) {
+        struct list_head *next = front ? node->next : node->prev;
+        if (!pack_value(list_entry(next, element_t, list), buf, bufsize,
+                        offsets, k, &used))
+            break;
+        node = next;
+    }
+    if (!k)
+        return 0;
+
+    LIST_HEAD(chain);
+    if (front) {
+        list_cut_position(&chain, head, node);
+    } else {
+        LIST_HEAD(keep);
+        list_cut_position(&keep, head, node->prev);
+        list_splice_init(head, &chain);
+        list_splice(&keep, head);
+    }
+
+    /* The middle index goes from n / 2 to (n - k) / 2. Once the old middle
+     * node is gone, the cursor is found again on demand.
+     */
+    int n0 = q->size, m = n0 / 2;
+    if (front ? m < k : m >= n0 - k)
+        q->mid = NULL;
+    else
+        mid_shift(q, (n0 - k) / 2 - (front ? m - k : m));
+    index_del(q, k, front);
+    q->size -= k;
+
+    element_t *element, *safe;
+    list_for_each_entry_safe (element, safe, &chain, list) {
+        hash_del(q, element);
+        q_release_element(element);
+    }
+    return k;
+}
+
+/* Remove and release several elements from head of queue */
+int q_remove_head_n(struct list_head *head,
+                    int n,
+                    char *buf,
+                    size_t bufsize,
+                    size_t *offsets)
+{
+    if (!head || n <= 0)
+        return 0;
+    return remove_n(q_header(head), n, buf, bufsize, offsets, true);
+}
+
+/* Remove and release several elements from tail of queue */
+int q_remove_tail_n(struct list_head *head,
+                    int n,
+                    char *buf,
+                    size_t bufsize,
+                    size_t *offsets)
+{
+    if (!head || n <= 0)
+        return 0;
+    return remove_n(q_header(head), n, buf, bufsize, offsets, false);
+}
+
 /* Return number of elements in queue */
 int q_size(struct list_head *head)
 {
-    int cnt = 0;
-    struct list_head *node;
-    list_for_each (node, head) {
-        ++cnt;
+    return head ? q_header(head)->size : 0;
+}
+
+/* Get the first node in queue without removing it */
+element_t *q_peek_head(struct list_head *head)
+{
+    if (!q_size(head))
+        return NULL;
+    queue_t *q = q_header(head);
+    if (q->ring.active)
+        return ring_at(q, 0);
+    return list_first_entry(head, element_t, list);
+}
+
+/* Get the last node in queue without removing it */
+element_t *q_peek_tail(struct list_head *head)
+{
+    if (!q_size(head))
+        return NULL;
+    queue_t *q = q_header(head);
+    if (q->ring.active)
+        return ring_at(q, q->size - 1);
+    return list_last_entry(head, element_t, list);
+}
+
+/* Link every element of queue into its list */
+void q_link(struct list_head *head)
+{
+    if (!head || !q_header(head)->ring.active)
+        return;
+    queue_t *q = q_header(head);
+    INIT_LIST_HEAD(head);
+    for (int i = 0; i < q->size; i++)
+        list_add_tail(&ring_at(q, i)->list, head);
+    q->ring.active = false;
+}
+
+/* Return the node at index n / 2 of a non-empty queue, walking half of it
+ * only when the cursor has been invalidated
+ */
+static struct list_head *q_mid(queue_t *q)
+{
+    if (!q->mid) {
+        struct list_head *node = q->head.next;
+        for (int i = q->size / 2; i > 0; i--)
+            node = node->next;
+        q->mid = node;
     }
-    return cnt;
+    return q->mid;
+}
+
+/* Get the middle node in queue without removing it */
+element_t *q_peek_mid(struct list_head *head)
+{
+    if (!q_size(head))
+        return NULL;
+    queue_t *q = q_header(head);
+    if (q->ring.active)
+        return ring_at(q, q->size / 2);
+    return list_entry(q_mid(q), element_t, list);
 }
 
 /* Delete the middle node in queue */
 bool q_delete_mid(struct list_head *head)
 {
     // https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
+    q_link(head);
     if (!head || list_empty(head)) {
         return false;
     }
-    struct list_head *slow = head, *fast = head;
-    do {
-        slow = slow->next;
-        fast = fast->next->next;
-    } while (fast != head && fast->next != head);
-    if (fast->next == head) {
-        slow = slow->next;
+    queue_t *q = q_header(head);
+    struct list_head *mid = q_mid(q);
+    mid_unlink(q, q->size / 2);
+    index_invalidate(q);
+    if (q->chunks.valid) {
+        int k = q->size / 2;
+        chunk_t *c = chunk_at(q, &k);
+        chunk_erase(q, c, k);
+    }
+    list_del(mid);
+    hash_del(q, container_of(mid, element_t, list));
+    q_release_element(container_of(mid, element_t, list));
+    q->size--;
+    return true;
+}
+
+/* Get the node at a given position in queue */
+element_t *q_get(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i >= q_size(head))
+        return NULL;
+    queue_t *q = q_header(head);
+    if (q->ring.active)
+        return ring_at(q, i);
+    struct q_index *idx = q_index(q);
+    if (!idx)
+        return NULL;
+    return list_entry(idx->slot[index_find(idx, i)].node, element_t, list);
+}
+
+/* Delete the node at a given position in queue */
+bool q_delete_at(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i >= q_size(head))
+        return false;
+    q_link(head);
+    queue_t *q = q_header(head);
+    struct q_index *idx = q_index(q);
+    if (!idx)
+        return false;
+
+    int k = index_find(idx, i);
+    struct list_head *node = idx->slot[k].node;
+    idx->slot[k].node = NULL;
+    for (; k <= idx->count; k += k & -k)
+        idx->slot[k].tree--;
+
+    mid_unlink(q, i);
+    if (q->chunks.valid) {
+        chunk_t *c = chunk_at(q, &i);
+        chunk_erase(q, c, i);
+    }
+    list_del(node);
+    hash_del(q, list_entry(node, element_t, list));
+    q_release_element(list_entry(node, element_t, list));
+    q->size--;
+
+    /* Rebuilding once the deleted slots outnumber the live ones keeps the
+     * searches short at an amortized constant cost per deletion
+     */
+    if (idx->count - idx->first + 1 > 2 * q->size)
+        idx->valid = false;
+    return true;
+}
+
+/* Hand the chunk entries from position i of q on over to rest, splitting the
+ * chunk that straddles the cut
+ */
+static bool chunks_cut(queue_t *q, queue_t *rest, int i)
+{
+    chunk_t *c = chunk_at(q, &i);
+    struct list_head *last = c->link.prev;
+    if (i > c->begin) {
+        chunk_t *d = chunk_get(rest, 0);
+        if (!d)
+            return false;
+        d->begin = i;
+        d->end = c->end;
+        memcpy(&d->item[i], &c->item[i], (c->end - i) * sizeof(c->item[0]));
+        c->end = i;
+        list_add(&d->link, &c->link);
+        last = &c->link;
+    }
+    LIST_HEAD(kept);
+    list_cut_position(&kept, &q->chunks.used, last);
+    list_splice_init(&q->chunks.used, &rest->chunks.used);
+    list_splice(&kept, &q->chunks.used);
+    return true;
+}
+
+/* Split queue in two at a given position */
+struct list_head *q_split(struct list_head *head, int i)
+{
+    if (!head || i < 0 || i > q_size(head))
+        return NULL;
+    q_link(head);
+    queue_t *q = q_header(head);
+    struct q_index *idx = NULL;
+    if (i < q->size && !(idx = q_index(q)))
+        return NULL;
+
+    queue_t *rest = malloc(sizeof(queue_t));
+    if (!rest)
+        return NULL;
+    INIT_LIST_HEAD(&rest->head);
+    rest->size = q->size - i;
+    rest->arena = test_arena_share(q->arena);
+    rest->mid = NULL;
+    rest->index = NULL;
+    rest->hash = NULL;
+    rest->backend = q->backend;
+    INIT_LIST_HEAD(&rest->chunks.used);
+    INIT_LIST_HEAD(&rest->chunks.spare);
+    rest->chunks.nspare = 0;
+    rest->chunks.valid = q->chunks.valid;
+    rest->ring.slot = rest->ring.old = NULL;
+    rest->ring.mask = rest->ring.head = rest->ring.lo = rest->ring.hi = 0;
+    rest->ring.active = false;
+    rest->ring.parked = NULL;
+
+    if (idx) {
+        int k = index_find(idx, i);
+        LIST_HEAD(kept);
+        list_cut_position(&kept, head, idx->slot[k].node->prev);
+        list_splice_init(head, &rest->head);
+        list_splice(&kept, head);
+        /* The slots before k still describe the nodes kept, since a Fenwick
+         * tree cut short remains a valid one
+         */
+        idx->count = k - 1;
+    }
+    if (q->chunks.valid && i < q->size && !chunks_cut(q, rest, i))
+        q->chunks.valid = rest->chunks.valid = false;
+    q->size = i;
+    q->mid = NULL;
+    hash_invalidate(q);
+    return &rest->head;
+}
+
+/* Delete all nodes that have duplicate string */
+bool q_delete_dup(struct list_head *head)
+{
+    // https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
+    if (!head) {
+        return false;
+    }
+    q_link(head);
+    queue_t *q = q_header(head);
+    q_relinked(q);
+    hash_invalidate(q);
+    element_t *element, *safe;
+    bool flag = false;
+    list_for_each_entry_safe (element, safe, head, list) {
+        if (&safe->list != head && !element_cmp(element, safe)) {
+            flag = true;
+            list_del(&element->list);
+            q_release_element(element);
+            q->size--;
+        } else if (flag) {
+            flag = false;
+            list_del(&element->list);
+            q_release_element(element);
+            q->size--;
+        }
+    }
+    return true;
+}
+
+/* Slot of the open-addressing table used by q_delete_dup_unsorted() */
+typedef struct {
+    element_t *first; /* First element seen with this value */
+    uint32_t hash;
+    bool dup; /* Whether the value occurs more than once */
+} dup_slot_t;
+
+/* Find the slot holding the value of e, or the empty slot where it belongs */
+static dup_slot_t *dup_lookup(dup_slot_t *table,
+                              size_t mask,
+                              element_t *e,
+                              uint64_t h)
+{
+    for (size_t i = h >> 32 & mask;; i = (i + 1) & mask) {
+        dup_slot_t *slot = &table[i];
+        if (!slot->first ||
+            (slot->hash == (uint32_t) h && !element_cmp(slot->first, e)))
+            return slot;
+    }
+}
+
+/* Delete all nodes that have duplicate string, in any order */
+bool q_delete_dup_unsorted(struct list_head *head)
+{
+    if (!head)
+        return false;
+    q_link(head);
+    queue_t *q = q_header(head);
+    if (q->size < 2)
+        return true;
+
+    size_t cap = 2;
+    while (cap < (size_t) q->size * 2)
+        cap <<= 1;
+    dup_slot_t *table = malloc(cap * sizeof(dup_slot_t));
+    if (!table)
+        return false;
+    memset(table, 0, cap * sizeof(dup_slot_t));
+
+    element_t *element, *safe;
+    list_for_each_entry (element, head, list) {
+        uint64_t h = str_hash(element_value(element));
+        dup_slot_t *slot = dup_lookup(table, cap - 1, element, h);
+        if (slot->first) {
+            slot->dup = true;
+        } else {
+            slot->first = element;
+            slot->hash = h;
+        }
+    }
+
+    /* Releasing has to wait until the table, which refers to the first
+     * occurrence of every value, is no longer needed.
+     */
+    LIST_HEAD(dups);
+    q_relinked(q);
+    hash_invalidate(q);
+    list_for_each_entry_safe (element, safe, head, list) {
+        uint64_t h = str_hash(element_value(element));
+        if (dup_lookup(table, cap - 1, element, h)->dup) {
+            list_move_tail(&element->list, &dups);
+            q->size--;
+        }
+    }
+    free(table);
+
+    list_for_each_entry_safe (element, safe, &dups, list)
+        q_release_element(element);
+    return true;
+}
+
+/* Return the index of values of q, rebuilding it if it is stale */
+static struct q_hash *q_hash(queue_t *q)
+{
+    struct q_hash *hash = q->hash;
+    if (hash && hash->valid)
+        return hash;
+    free(hash);
+    q->hash = hash = hash_alloc(q->size);
+    if (!hash)
+        return NULL;
+
+    element_t *element;
+    if (q->ring.active) {
+        for (int i = 0; i < q->size; i++) {
+            element = ring_at(q, i);
+            element->hash = str_hash(element_value(element)) >> 32;
+            hash_put(hash, element);
+        }
+    } else {
+        list_for_each_entry (element, &q->head, list) {
+            element->hash = str_hash(element_value(element)) >> 32;
+            hash_put(hash, element);
+        }
+    }
+    return hash;
+}
+
+/* Find a node of queue by its string */
+element_t *q_find(struct list_head *head, const char *s)
+{
+    if (!head || !s)
+        return NULL;
+    struct q_hash *hash = q_hash(q_header(head));
+    if (!hash)
+        return NULL;
+    uint32_t h = str_hash(s) >> 32;
+    for (unsigned int i = h & hash->mask; hash->slot[i];
+         i = (i + 1) & hash->mask) {
+        element_t *element = hash_entry(hash->slot[i]);
+        if (element->hash == h && !strcmp(element_value(element), s))
+            return element;
     }
-    list_del(slow);
-    q_release_element(container_of(slow, element_t, list));
-    return true;
+    return NULL;
 }
 
-/* Delete all nodes that have duplicate string */
-bool q_delete_dup(struct list_head *head)
+/* Delete a node of queue by its string */
+bool q_delete_value(struct list_head *head, const char *s)
 {
-    // https://leetcode.com/problems/remove-duplicates-from-sorted-list-ii/
-    if (!head) {
+    element_t *element = q_find(head, s);
+    if (!element)
         return false;
+    q_link(head);
+    queue_t *q = q_header(head);
+    q->mid = NULL;
+    index_invalidate(q);
+    if (q->chunks.valid) {
+        int k = 0;
+        chunk_t *c = chunk_of(q, element, &k);
+        chunk_erase(q, c, k);
     }
-    element_t *element, *safe;
-    bool flag = false;
-    list_for_each_entry_safe (element, safe, head, list) {
-        if (&safe->list != head && !strcmp(element->value, safe->value)) {
-            flag = true;
-            list_del(&element->list);
-            q_release_element(element);
-        } else if (flag) {
-            flag = false;
-            list_del(&element->list);
-            q_release_element(element);
-        }
-    }
+    hash_del(q, element);
+    list_del(&element->list);
+    q_release_element(element);
+    q->size--;
     return true;
 }
 
@@ -153,6 +1483,7 @@ bool q_delete_dup(struct list_head *head)
 void q_swap(struct list_head *head)
 {
     // https://leetcode.com/problems/swap-nodes-in-pairs/
+    q_link(head);
     struct list_head *node1, *node2, *safe;
     for (node1 = head->next, node2 = node1->next, safe = node2->next;
          node1 != head && node2 != head;
@@ -160,42 +1491,80 @@ void q_swap(struct list_head *head)
         list_del(node1);
         list_add(node1, node2);
     }
+    q_relinked(q_header(head));
+}
+
+/* Reverse the order of the chunks of an unrolled queue and of the entries of
+ * each chunk, then relink the elements to match
+ */
+static void chunks_reverse(queue_t *q)
+{
+    struct list_head *node, *safe;
+    list_for_each_safe (node, safe, &q->chunks.used) {
+        chunk_t *c = list_entry(node, chunk_t, link);
+        for (int i = c->begin, j = c->end - 1; i < j; i++, j--) {
+            chunk_item_t tmp = c->item[i];
+            c->item[i] = c->item[j];
+            c->item[j] = tmp;
+        }
+        list_move(node, &q->chunks.used);
+    }
+    chunks_relink(q);
 }
 
 /* Reverse elements in queue */
 void q_reverse(struct list_head *head)
 {
-    struct list_head *node, *safe, *temp;
-    list_for_each_safe (node, safe, head) {
-        temp = node->next;
-        node->next = node->prev;
-        node->prev = temp;
+    q_link(head);
+    queue_t *q = q_header(head);
+    if (q->chunks.valid) {
+        chunks_reverse(q);
+    } else {
+        struct list_head *node, *safe, *temp;
+        list_for_each_safe (node, safe, head) {
+            temp = node->next;
+            node->next = node->prev;
+            node->prev = temp;
+        }
+        temp = head->next;
+        head->next = head->prev;
+        head->prev = temp;
     }
-    temp = head->next;
-    head->next = head->prev;
-    head->prev = temp;
+
+    /* The old middle now sits at index n / 2 - 1 when n is even */
+    if (q->mid && !(q->size & 1))
+        q->mid = q->mid->next;
+    index_invalidate(q);
 }
 
 /* Reverse the nodes of the list k at a time */
 void q_reverseK(struct list_head *head, int k)
 {
     // https://leetcode.com/problems/reverse-nodes-in-k-group/
-    struct list_head *node;
-    for (node = head->next; node != head;) {
-        LIST_HEAD(stack);
-        struct list_head *safe;
-        int n;
-        for (n = 0, safe = node->next; n < k && node != head;
-             n++, node = safe, safe = node->next) {
-            list_del(node);
-            list_add(node, &stack);
-        }
-        while (!list_empty(&stack)) {
-            struct list_head *temp = n == k ? stack.next : stack.prev;
-            list_del(temp);
-            list_add_tail(temp, node);
+    if (!head || k < 2)
+        return;
+    q_link(head);
+    queue_t *q = q_header(head);
+    struct list_head *before = head;
+    for (int groups = q->size / k; groups > 0; groups--) {
+        /* Swap the links of each node in the group, which reverses it inside,
+         * then hook both of its ends back into the list
+         */
+        struct list_head *first = before->next, *node = first;
+        for (int i = 0; i < k; i++) {
+            struct list_head *next = node->next;
+            node->next = node->prev;
+            node->prev = next;
+            node = next;
         }
+        struct list_head *last = node->prev;
+        before->next = last;
+        last->prev = before;
+        first->next = node;
+        node->prev = first;
+        before = first;
     }
+    q_relinked(q);
 }
 
 typedef struct {
@@ -203,14 +1572,67 @@ typedef struct {
     struct list_head list;
 } list_t;
 
-static void merge_tail_init(list_t *list, list_t *head)
+/* The merge and sort below are written once with the direction as a parameter
+ * and force-inlined into one instance per direction, see SORT_INSTANCE(), so
+ * that the direction is a compile-time constant in every comparison.
+ */
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+/* Element comparisons for the orderings other than COMPARE_STRCMP, whose own
+ * element_cmp() is above
+ */
+static __always_inline int natural_cmp(element_t *a, element_t *b)
+{
+    return natural_strcmp(element_value(a), element_value(b));
+}
+
+static __always_inline int nocase_cmp(element_t *a, element_t *b)
+{
+    return strcasecmp(element_value(a), element_value(b));
+}
+
+/* Strings of equal length still go through the cached prefixes */
+static __always_inline int length_cmp(element_t *a, element_t *b)
+{
+    size_t la = strlen(element_value(a)), lb = strlen(element_value(b));
+    if (la != lb)
+        return la < lb ? -1 : 1;
+    return element_cmp(a, b);
+}
+
+static __always_inline int custom_cmp(element_t *a, element_t *b)
+{
+    return q_compare_fn(element_value(a), element_value(b));
+}
+
+/* Every ordering with its element comparison, in COMPARE_* order */
+#define COMPARATORS(_)      \
+    _(strcmp, element_cmp)  \
+    _(natural, natural_cmp) \
+    _(nocase, nocase_cmp)   \
+    _(length, length_cmp)   \
+    _(custom, custom_cmp)
+
+typedef int (*element_cmp_t)(element_t *a, element_t *b);
+
+/* Merge sorted list into sorted head, which holds the earlier nodes. On ties
+ * the node of head goes first, keeping the merge stable in both directions.
+ */
+static __always_inline void merge_tail_init(list_t *list,
+                                            list_t *head,
+                                            bool descend,
+                                            element_cmp_t cmp_fn)
 {
     list_t c;
     INIT_LIST_HEAD(&c.list);
     while (!list_empty(&head->list) && !list_empty(&list->list)) {
-        int cmp = strcmp(container_of(head->list.next, element_t, list)->value,
-                         container_of(list->list.next, element_t, list)->value);
-        struct list_head *curr = cmp <= 0 ? head->list.next : list->list.next;
+        element_t *a = list_first_entry(&head->list, element_t, list);
+        element_t *b = list_first_entry(&list->list, element_t, list);
+        int cmp = cmp_fn(a, b);
+        bool first = descend ? cmp >= 0 : cmp <= 0;
+        struct list_head *curr = first ? head->list.next : list->list.next;
         list_del(curr);
         list_add_tail(curr, &c.list);
     }
@@ -224,10 +1646,15 @@ static void merge_tail_init(list_t *list, list_t *head)
     }
 }
 
-/* Sort elements of queue in ascending/descending order */
-void q_sort(struct list_head *head, bool descend)
+/* Sort a list with an adaptive stack of sorted runs */
+static __always_inline void list_sort_impl(list_t *list,
+                                           bool descend,
+                                           element_cmp_t cmp_fn)
 {
-    int stack_cap = 33 - __builtin_clz(q_size(head) - 1);
+    if (list->size < 2)
+        return;
+    struct list_head *head = &list->list;
+    int stack_cap = 33 - __builtin_clz(list->size - 1);
     list_t stack[33];
     for (int i = 0; i < stack_cap; ++i) {
         INIT_LIST_HEAD(&stack[i].list);
@@ -241,34 +1668,39 @@ void q_sort(struct list_head *head, bool descend)
         stack[stack_size++].size = 1;
         while (stack_size >= 2 &&
                stack[stack_size - 2].size <= stack[stack_size - 1].size) {
-            merge_tail_init(stack + stack_size - 1, stack + stack_size - 2);
+            merge_tail_init(stack + stack_size - 1, stack + stack_size - 2,
+                            descend, cmp_fn);
             --stack_size;
         }
     }
 
     while (stack_size >= 2) {
-        merge_tail_init(stack + stack_size - 1, stack + stack_size - 2);
+        merge_tail_init(stack + stack_size - 1, stack + stack_size - 2,
+                        descend, cmp_fn);
         --stack_size;
     }
     list_splice(&stack->list, head);
-    if (descend)
-        q_reverse(head);
 }
 
-/* Remove every node which has a node with a strictly less value anywhere to
- * the right side of it */
-int q_ascend(struct list_head *head)
+/* Remove every node followed somewhere by a node that sorts strictly before
+ * it, or strictly after it if descend, walking from the tail while keeping
+ * the smallest (largest) node seen so far
+ */
+static __always_inline int monotone_impl(struct list_head *head,
+                                         bool descend,
+                                         element_cmp_t cmp_fn)
 {
-    // https://leetcode.com/problems/remove-nodes-from-linked-list/
     int cnt = 0;
     struct list_head *node, *safe;
-    char *min_str = NULL;
+    element_t *best = NULL;
     for (node = head->prev, safe = node->prev; node != head;
          node = safe, safe = node->prev) {
         element_t *element = container_of(node, element_t, list);
-        int cmp = min_str ? strcmp(element->value, min_str) : -1;
+        int cmp = best ? cmp_fn(element, best) : -1;
+        if (best && descend)
+            cmp = -cmp;
         if (cmp < 0) {
-            min_str = element->value;
+            best = element;
             ++cnt;
         } else if (cmp > 0) {
             list_del(&element->list);
@@ -280,57 +1712,647 @@ int q_ascend(struct list_head *head)
     return cnt;
 }
 
+typedef struct {
+    list_t *dst, *src;
+} merge_job_t;
+
+/* Instantiate the merge, the sort, their thread entry points and the
+ * monotone filter for one ordering and direction
+ */
+#define SORT_INSTANCE(name, cmp, descend)                  \
+    static void merge_##name(list_t *list, list_t *head)   \
+    {                                                      \
+        merge_tail_init(list, head, descend, cmp);         \
+    }                                                      \
+    static void list_sort_##name(list_t *list)             \
+    {                                                      \
+        list_sort_impl(list, descend, cmp);                \
+    }                                                      \
+    static void *sort_worker_##name(void *arg)             \
+    {                                                      \
+        list_sort_##name(arg);                             \
+        return NULL;                                       \
+    }                                                      \
+    static void *merge_worker_##name(void *arg)            \
+    {                                                      \
+        merge_job_t *job = arg;                            \
+        merge_##name(job->src, job->dst);                  \
+        return NULL;                                       \
+    }                                                      \
+    static int monotone_##name(struct list_head *head)     \
+    {                                                      \
+        return monotone_impl(head, descend, cmp);          \
+    }
+
+#define SORT_INSTANCES(name, cmp)            \
+    SORT_INSTANCE(name##_asc, cmp, false)    \
+    SORT_INSTANCE(name##_desc, cmp, true)
+
+COMPARATORS(SORT_INSTANCES)
+
+/* Entry points of the instances for one ordering and direction */
+typedef struct {
+    void (*merge)(list_t *list, list_t *head);
+    void (*sort)(list_t *list);
+    void *(*sort_worker)(void *arg);
+    void *(*merge_worker)(void *arg);
+    int (*monotone)(struct list_head *head);
+} sort_ops_t;
+
+#define SORT_OPS(name)                                               \
+    {                                                                \
+        merge_##name, list_sort_##name, sort_worker_##name,          \
+            merge_worker_##name, monotone_##name                     \
+    }
+#define SORT_OPS_PAIR(name, cmp) {SORT_OPS(name##_asc), SORT_OPS(name##_desc)},
+
+static const sort_ops_t sort_ops_table[][2] = {COMPARATORS(SORT_OPS_PAIR)};
+
+/* Ordering in effect, falling back to byte order when q_compare is out of
+ * range or asks for a custom comparison that is not set
+ */
+static inline int compare_kind(void)
+{
+    if (q_compare < COMPARE_STRCMP || q_compare > COMPARE_CUSTOM ||
+        (q_compare == COMPARE_CUSTOM && !q_compare_fn))
+        return COMPARE_STRCMP;
+    return q_compare;
+}
+
+static inline const sort_ops_t *sort_ops(bool descend)
+{
+    return &sort_ops_table[compare_kind()][descend];
+}
+
+static void merge_runs(list_t *list, list_t *head, bool descend)
+{
+    sort_ops(descend)->merge(list, head);
+}
+
+static void list_sort(list_t *list, bool descend)
+{
+    sort_ops(descend)->sort(list);
+}
+
+/* Open a section in which the calling thread starts workers and joins them.
+ * The SIGALRM handler of qtest longjmps out of the calling thread, which would
+ * leave the workers running on its unwound stack, so the signal is held off
+ * until fork_join_end() once every worker is joined. A time limit that expired
+ * meanwhile then takes effect right away.
+ */
+static inline void fork_join_begin(sigset_t *old)
+{
+    sigset_t alarm;
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm, old);
+}
+
+static inline void fork_join_end(const sigset_t *old)
+{
+    pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+/* Start a worker with every signal blocked, as workers never handle any */
+static bool fork_worker(pthread_t *tid, void *(*fn)(void *), void *arg)
+{
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    bool spawned = !pthread_create(tid, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return spawned;
+}
+
+/* Run fn on each of the njobs records of size stride starting at jobs, one
+ * thread per record. The calling thread takes the first record itself, and a
+ * record whose thread cannot be created is run inline as well.
+ */
+static void run_parallel(void *(*fn)(void *),
+                         void *jobs,
+                         size_t stride,
+                         int njobs)
+{
+    pthread_t tid[MAX_THREADS];
+    bool spawned[MAX_THREADS] = {false};
+
+    sigset_t old;
+    fork_join_begin(&old);
+    for (int i = 1; i < njobs; i++)
+        spawned[i] =
+            fork_worker(&tid[i], fn, (char *) jobs + (size_t) i * stride);
+
+    fn(jobs);
+    for (int i = 1; i < njobs; i++) {
+        if (spawned[i])
+            pthread_join(tid[i], NULL);
+        else
+            fn((char *) jobs + (size_t) i * stride);
+    }
+    fork_join_end(&old);
+}
+
+/* Cut the list into nthreads runs of nearly equal length, sort them
+ * concurrently and merge neighbouring runs pairwise, again concurrently, until
+ * one run is left. Only the stack of each thread is used as workspace.
+ */
+static void parallel_sort(list_t *list, int nthreads, bool descend)
+{
+    list_t part[MAX_THREADS];
+    for (int i = 0; i < nthreads; i++) {
+        int len = list->size / nthreads + (i < list->size % nthreads);
+        struct list_head *cut = &list->list;
+        for (int n = 0; n < len; n++)
+            cut = cut->next;
+        INIT_LIST_HEAD(&part[i].list);
+        list_cut_position(&part[i].list, &list->list, cut);
+        part[i].size = len;
+    }
+    run_parallel(sort_ops(descend)->sort_worker, part, sizeof(list_t),
+                 nthreads);
+
+    for (int step = 1; step < nthreads; step *= 2) {
+        merge_job_t job[MAX_THREADS];
+        int njobs = 0;
+        for (int i = 0; i + step < nthreads; i += 2 * step)
+            job[njobs++] =
+                (merge_job_t){.dst = part + i, .src = part + i + step};
+        run_parallel(sort_ops(descend)->merge_worker, job,
+                     sizeof(merge_job_t), njobs);
+    }
+    list_splice(&part->list, &list->list);
+}
+
+/* Stable insertion sort for the short buckets left over by radix_sort() */
+static void insertion_sort(list_t *list, bool descend)
+{
+    LIST_HEAD(sorted);
+    struct list_head *node, *safe;
+    list_for_each_safe (node, safe, &list->list) {
+        element_t *e = list_entry(node, element_t, list);
+        struct list_head *pos = sorted.prev;
+        for (; pos != &sorted; pos = pos->prev) {
+            int cmp = element_cmp(list_entry(pos, element_t, list), e);
+            if (descend ? cmp >= 0 : cmp <= 0)
+                break;
+        }
+        list_move(node, pos);
+    }
+    list_splice(&sorted, &list->list);
+}
+
+/* Byte at offset depth of the value of e, read from the cached prefix while
+ * depth is within it. Only called on strings known to be longer than depth-1.
+ */
+static inline unsigned char key_byte(element_t *e, int depth)
+{
+    if (depth < 8)
+        return e->prefix >> (56 - 8 * depth);
+    return element_value(e)[depth];
+}
+
+/* MSD radix sort of a list whose values share their first depth bytes.
+ * Elements are distributed by their byte at depth into 256 buckets, kept in
+ * arrival order so the sort is stable, and the buckets are concatenated in
+ * ascending or descending byte order. Bucket 0 holds strings that end at depth
+ * and are therefore equal.
+ */
+static void radix_sort(list_t *list, int depth, bool descend)
+{
+    if (list->size < RADIX_SORT_MIN) {
+        insertion_sort(list, descend);
+        return;
+    }
+    if (depth >= RADIX_MAX_DEPTH) {
+        list_sort(list, descend);
+        return;
+    }
+
+    list_t bucket[256];
+    int lo = 255, hi = 0;
+    for (int i = 0; i < 256; i++) {
+        INIT_LIST_HEAD(&bucket[i].list);
+        bucket[i].size = 0;
+    }
+    struct list_head *node, *safe;
+    list_for_each_safe (node, safe, &list->list) {
+        unsigned char b = key_byte(list_entry(node, element_t, list), depth);
+        list_move_tail(node, &bucket[b].list);
+        bucket[b].size++;
+        lo = b < lo ? b : lo;
+        hi = b > hi ? b : hi;
+    }
+
+    for (int i = descend ? hi : lo; descend ? i >= lo : i <= hi;
+         i += descend ? -1 : 1) {
+        if (!bucket[i].size)
+            continue;
+        if (i && bucket[i].size > 1)
+            radix_sort(&bucket[i], depth + 1, descend);
+        list_splice_tail(&bucket[i].list, &list->list);
+    }
+}
+
+/* Whether chunk entry a has to precede entry b, which comes first on ties */
+static inline bool item_before(const chunk_item_t *a,
+                               const chunk_item_t *b,
+                               bool descend)
+{
+    int cmp = item_cmp(a, b);
+    return descend ? cmp > 0 : cmp < 0;
+}
+
+static void chunk_insertion_sort(chunk_t *c, bool descend)
+{
+    for (int i = c->begin + 1; i < c->end; i++) {
+        chunk_item_t item = c->item[i];
+        int j = i;
+        for (; j > c->begin && item_before(&item, &c->item[j - 1], descend);
+             j--)
+            c->item[j] = c->item[j - 1];
+        c->item[j] = item;
+    }
+}
+
+/* Take a spare chunk of q as output of a merge. Sorting must not allocate, and
+ * need not: q_sort() only sorts chunks with CHUNK_SPARES of them at hand, and
+ * chunk_merge() keeps at least one.
+ */
+static chunk_t *chunk_spare(queue_t *q)
+{
+    assert(q->chunks.nspare > 0);
+    return chunk_get(q, 0);
+}
+
+/* Merge the sorted run of chunks b into the sorted run a, whose entries come
+ * first on ties. Output goes to spare chunks, and every input chunk becomes a
+ * spare as soon as it is drained. The chunk the merge stopped in is drained as
+ * well, so that every output chunk is paid for by a drained one: the spares
+ * never run out while two are at hand, however many merges follow.
+ */
+static void chunk_merge(queue_t *q,
+                        struct list_head *a,
+                        struct list_head *b,
+                        bool descend)
+{
+    LIST_HEAD(out);
+    chunk_t *o = NULL;
+    while (!list_empty(a) && !list_empty(b)) {
+        chunk_t *x = list_first_entry(a, chunk_t, link);
+        chunk_t *y = list_first_entry(b, chunk_t, link);
+        chunk_t *src =
+            item_before(&y->item[y->begin], &x->item[x->begin], descend) ? y
+                                                                          : x;
+        if (!o || o->end == CHUNK_ITEMS) {
+            o = chunk_spare(q);
+            list_add_tail(&o->link, &out);
+        }
+        o->item[o->end++] = src->item[src->begin++];
+        if (src->begin == src->end)
+            chunk_put(q, src);
+    }
+    list_splice_tail_init(b, a);
+
+    if (o && !list_empty(a)) {
+        chunk_t *rest = list_first_entry(a, chunk_t, link);
+        while (rest->begin < rest->end) {
+            if (o->end == CHUNK_ITEMS) {
+                o = chunk_spare(q);
+                list_add_tail(&o->link, &out);
+            }
+            o->item[o->end++] = rest->item[rest->begin++];
+        }
+        chunk_put(q, rest);
+    }
+    list_splice(&out, a);
+}
+
+/* Sort the chunks of an unrolled queue with a bottom-up merge sort whose runs
+ * are lists of chunks, then relink the elements to match
+ */
+static void chunks_sort(queue_t *q, bool descend)
+{
+    struct list_head pending[32];
+    for (int i = 0; i < 32; i++)
+        INIT_LIST_HEAD(&pending[i]);
+
+    while (!list_empty(&q->chunks.used)) {
+        chunk_t *c = list_first_entry(&q->chunks.used, chunk_t, link);
+        if (c->begin == c->end) {
+            chunk_put(q, c);
+            continue;
+        }
+        chunk_insertion_sort(c, descend);
+        LIST_HEAD(run);
+        list_move(&c->link, &run);
+
+        /* Every level holds runs of twice as many chunks as the one below,
+         * and the earlier ones, hence the merge order
+         */
+        int i = 0;
+        for (; !list_empty(&pending[i]); i++) {
+            chunk_merge(q, &pending[i], &run, descend);
+            list_splice_init(&pending[i], &run);
+        }
+        list_splice(&run, &pending[i]);
+    }
+
+    LIST_HEAD(merged);
+    for (int i = 0; i < 32; i++) {
+        if (list_empty(&pending[i]))
+            continue;
+        chunk_merge(q, &pending[i], &merged, descend);
+        list_splice_init(&pending[i], &merged);
+    }
+    list_splice(&merged, &q->chunks.used);
+    chunks_relink(q);
+}
+
+/* Sort elements of queue in ascending/descending order */
+void q_sort(struct list_head *head, bool descend)
+{
+    if (q_size(head) < 2)
+        return;
+
+    q_link(head);
+    queue_t *q = q_header(head);
+    bool bytewise = compare_kind() == COMPARE_STRCMP;
+    if (bytewise && q->chunks.valid && q->chunks.nspare >= CHUNK_SPARES) {
+        chunks_sort(q, descend);
+        q->mid = NULL;
+        index_invalidate(q);
+        return;
+    }
+
+    list_t all = {.size = q_size(head)};
+    INIT_LIST_HEAD(&all.list);
+    list_splice_init(head, &all.list);
+
+    int nthreads = q_threads < MAX_THREADS ? q_threads : MAX_THREADS;
+    if (bytewise && q_sort_algo == SORT_RADIX)
+        radix_sort(&all, 0, descend);
+    else if (nthreads > 1 && all.size >= PARALLEL_SORT_MIN)
+        parallel_sort(&all, nthreads, descend);
+    else
+        list_sort(&all, descend);
+
+    list_splice(&all.list, head);
+    q_relinked(q_header(head));
+}
+
+/* Remove every node which has a node with a strictly less value anywhere to
+ * the right side of it */
+int q_ascend(struct list_head *head)
+{
+    // https://leetcode.com/problems/remove-nodes-from-linked-list/
+    q_link(head);
+    int cnt = sort_ops(false)->monotone(head);
+    q_header(head)->size = cnt;
+    q_relinked(q_header(head));
+    hash_invalidate(q_header(head));
+    return cnt;
+}
+
 /* Remove every node which has a node with a strictly greater value anywhere to
  * the right side of it */
 int q_descend(struct list_head *head)
 {
     // https://leetcode.com/problems/remove-nodes-from-linked-list/
-    int cnt = 0;
-    struct list_head *node, *safe;
-    char *max_str = NULL;
-    for (node = head->prev, safe = node->prev; node != head;
-         node = safe, safe = node->prev) {
-        element_t *element = container_of(node, element_t, list);
-        int cmp = max_str ? strcmp(element->value, max_str) : 1;
-        if (cmp > 0) {
-            max_str = element->value;
-            ++cnt;
-        } else if (cmp < 0) {
-            list_del(&element->list);
-            q_release_element(element);
-        } else {
-            ++cnt;
+    q_link(head);
+    int cnt = sort_ops(true)->monotone(head);
+    q_header(head)->size = cnt;
+    q_relinked(q_header(head));
+    hash_invalidate(q_header(head));
+    return cnt;
+}
+
+/* Move the nodes and the length of src into the empty run dst */
+static void move_run(list_t *dst, list_t *src)
+{
+    list_splice_init(&src->list, &dst->list);
+    dst->size = src->size;
+    src->size = 0;
+}
+
+/* Merge queue b into queue a, whose nodes come first on ties */
+static void merge_queues(struct list_head *a, struct list_head *b, bool descend)
+{
+    list_t x = {.size = q_size(a)}, y = {.size = q_size(b)};
+    INIT_LIST_HEAD(&x.list);
+    INIT_LIST_HEAD(&y.list);
+    list_splice_init(a, &x.list);
+    list_splice_init(b, &y.list);
+    merge_runs(&y, &x, descend);
+    list_splice(&x.list, a);
+    q_header(a)->size = x.size;
+    q_header(b)->size = 0;
+}
+
+/* Stretch of the chain, from first up to but excluding stop, in which one
+ * worker merges neighbouring non-empty queues pairwise
+ */
+typedef struct {
+    struct list_head *first, *stop;
+    bool descend;
+} merge_segment_t;
+
+static inline struct list_head *chain_queue(struct list_head *node)
+{
+    return list_entry(node, queue_contex_t, chain)->q;
+}
+
+static void *merge_segment(void *arg)
+{
+    merge_segment_t *seg = arg;
+    struct list_head *a = NULL;
+    for (struct list_head *node = seg->first; node != seg->stop;
+         node = node->next) {
+        if (!q_size(chain_queue(node)))
+            continue;
+        if (!a) {
+            a = chain_queue(node);
+            continue;
         }
+        merge_queues(a, chain_queue(node), seg->descend);
+        a = NULL;
     }
-    return cnt;
+    return NULL;
 }
 
-static void swap(list_t *a, list_t *b)
+/* Threads kept for every level of parallel_merge(). For each level the
+ * calling thread lays out the segments, then all members meet, merge the
+ * segment matching their id and meet again once every segment is merged.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int size;           /* Members, the calling thread included */
+    int arrived;        /* Members waiting at the current meeting */
+    unsigned int round; /* Meetings held so far */
+    bool done;          /* Set once no level is left, letting workers return */
+    int nseg;
+    merge_segment_t seg[MAX_THREADS];
+} merge_crew_t;
+
+typedef struct {
+    merge_crew_t *crew;
+    int id;
+} crew_member_t;
+
+/* Wait until every member of the crew gets here */
+static void crew_meet(merge_crew_t *crew)
 {
-    list_t c;
-    INIT_LIST_HEAD(&c.list);
-    list_splice_init(&a->list, &c.list);
-    c.size = a->size;
-    list_splice_init(&b->list, &a->list);
-    a->size = b->size;
-    list_splice_init(&c.list, &b->list);
-    b->size = c.size;
-}
-
-static void heapify(list_t *heap, int heap_size, int curr)
-{
-    while (curr < heap_size) {
-        int left = 2 * curr + 1, right = 2 * curr + 2;
-        left = left < heap_size ? left : curr;
-        right = right < heap_size ? right : curr;
-        if (heap[curr].size <= heap[left].size &&
-            heap[curr].size <= heap[right].size) {
+    pthread_mutex_lock(&crew->lock);
+    unsigned int round = crew->round;
+    if (++crew->arrived == crew->size) {
+        crew->arrived = 0;
+        crew->round++;
+        pthread_cond_broadcast(&crew->cond);
+    } else {
+        while (round == crew->round)
+            pthread_cond_wait(&crew->cond, &crew->lock);
+    }
+    pthread_mutex_unlock(&crew->lock);
+}
+
+static void *crew_worker(void *arg)
+{
+    crew_member_t *member = arg;
+    merge_crew_t *crew = member->crew;
+    for (;;) {
+        crew_meet(crew);
+        if (crew->done)
+            return NULL;
+        if (member->id < crew->nseg)
+            merge_segment(&crew->seg[member->id]);
+        crew_meet(crew);
+    }
+}
+
+static double elapsed(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) (now.tv_sec - start->tv_sec) +
+           (double) (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+/* Merge the queues of the chain as a tree. On every level neighbouring
+ * non-empty queues are merged pairwise, the later one into the earlier one,
+ * and the pairs are split into nthreads stretches holding about the same
+ * number of elements, which are merged concurrently by a crew of threads
+ * started once for all levels. The queues themselves hold the intermediate
+ * runs, so the only workspace is one record per thread.
+ * Return the queue left holding every element.
+ */
+static struct list_head *parallel_merge(struct list_head *head,
+                                        int total,
+                                        int nthreads,
+                                        bool descend)
+{
+    merge_crew_t crew = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER,
+        .size = nthreads,
+    };
+    crew_member_t member[MAX_THREADS];
+    pthread_t tid[MAX_THREADS];
+
+    sigset_t old;
+    fork_join_begin(&old);
+    for (int i = 1; i < nthreads; i++) {
+        member[i] = (crew_member_t){.crew = &crew, .id = i};
+        if (!fork_worker(&tid[i], crew_worker, &member[i])) {
+            /* The workers started are still waiting for the first level */
+            pthread_mutex_lock(&crew.lock);
+            crew.size = i;
+            pthread_mutex_unlock(&crew.lock);
+            break;
+        }
+    }
+    nthreads = crew.size;
+
+    struct list_head *merged;
+    for (;;) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        merge_segment_t *seg = crew.seg;
+        int nseg = 0, runs = 0;
+        long acc = 0;
+        struct list_head *node, *last = NULL;
+        list_for_each (node, head) {
+            int size = q_size(chain_queue(node));
+            if (!size)
+                continue;
+            /* A new stretch may only start at the first queue of a pair */
+            if (!(runs++ & 1) &&
+                (!nseg || (acc >= (long) total * nseg / nthreads &&
+                           nseg < nthreads))) {
+                if (nseg)
+                    seg[nseg - 1].stop = node;
+                seg[nseg++] = (merge_segment_t){.first = node,
+                                                .descend = descend};
+            }
+            acc += size;
+            last = node;
+        }
+        if (runs <= 1) {
+            merged = last ? chain_queue(last) : NULL;
             break;
         }
-        int down = heap[left].size <= heap[right].size ? left : right;
-        swap(heap + down, heap + curr);
-        curr = down;
+        seg[nseg - 1].stop = head;
+
+        crew.nseg = nseg;
+        crew_meet(&crew);
+        merge_segment(&seg[0]);
+        crew_meet(&crew);
+
+        if (q_merge_stats.levels < MERGE_MAX_LEVELS) {
+            int level = q_merge_stats.levels++;
+            q_merge_stats.runs[level] = runs;
+            q_merge_stats.seconds[level] = elapsed(&start);
+        }
+    }
+
+    crew.done = true;
+    crew_meet(&crew);
+    for (int i = 1; i < nthreads; i++)
+        pthread_join(tid[i], NULL);
+    pthread_mutex_destroy(&crew.lock);
+    pthread_cond_destroy(&crew.cond);
+    fork_join_end(&old);
+    return merged;
+}
+
+/* Give every chunk of src, whose elements all go to dst, to dst as a spare */
+static void chunks_hand_over(queue_t *dst, queue_t *src)
+{
+    chunk_t *c, *safe;
+    list_for_each_entry_safe (c, safe, &src->chunks.used, link)
+        chunk_put(dst, c);
+    dst->chunks.nspare += src->chunks.nspare;
+    src->chunks.nspare = 0;
+    list_splice_init(&src->chunks.spare, &dst->chunks.spare);
+    src->chunks.valid = src->backend == QUEUE_UNROLLED;
+    /* The arrays of the ring of src now live in the arena of dst as well.
+     * Merging must not free, so dst parks them until q_free().
+     */
+    element_t **rings[] = {src->ring.slot, src->ring.old};
+    for (int i = 0; i < 2; i++) {
+        if (rings[i]) {
+            *(void **) rings[i] = dst->ring.parked;
+            dst->ring.parked = rings[i];
+        }
+    }
+    while (src->ring.parked) {
+        void *ring = src->ring.parked;
+        src->ring.parked = *(void **) ring;
+        *(void **) ring = dst->ring.parked;
+        dst->ring.parked = ring;
     }
+    src->ring.slot = src->ring.old = NULL;
+    src->ring.mask = src->ring.head = src->ring.lo = src->ring.hi = 0;
 }
 
 /* Merge all the queues into one sorted queue, which is in ascending/descending
@@ -338,32 +2360,81 @@ static void heapify(list_t *heap, int heap_size, int curr)
 int q_merge(struct list_head *head, bool descend)
 {
     // https://leetcode.com/problems/merge-k-sorted-lists/
-    int heap_size = q_size(head);
-    list_t heap[100];
+    if (!head || list_empty(head))
+        return 0;
+    struct list_head *ret = list_first_entry(head, queue_contex_t, chain)->q;
+    if (!ret)
+        return 0;
+    q_merge_stats.levels = 0;
+
+    int total = 0;
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, head, chain) {
+        total += q_size(ctx->q);
+        q_link(ctx->q);
+        q_relinked(q_header(ctx->q));
+        hash_invalidate(q_header(ctx->q));
+        /* The first queue takes over the storage of the elements it gets */
+        if (ctx->q != ret) {
+            test_arena_absorb(q_header(ret)->arena, q_header(ctx->q)->arena);
+            chunks_hand_over(q_header(ret), q_header(ctx->q));
+        }
+    }
 
-    struct list_head *next = head->next;
-    for (int i = 0; i < heap_size; ++i) {
-        INIT_LIST_HEAD(&heap[i].list);
-        list_splice_init(container_of(next, queue_contex_t, chain)->q,
-                         &heap[i].list);
-        heap[i].size = q_size(&heap[i].list);
-        next = next->next;
+    int nthreads = q_threads < MAX_THREADS ? q_threads : MAX_THREADS;
+    if (nthreads > 1 && total >= PARALLEL_MERGE_MIN) {
+        struct list_head *merged =
+            parallel_merge(head, total, nthreads, descend);
+        if (merged && merged != ret) {
+            list_splice_init(merged, ret);
+            q_header(ret)->size = q_size(merged);
+            q_header(merged)->size = 0;
+        }
+        return q_size(ret);
     }
 
-    for (int i = heap_size - 1; i >= 0; i--) {
-        heapify(heap, heap_size, i);
+    /* Queues are merged pairwise in the manner of a binary counter: the
+     * merge of 2^i consecutive non-empty queues waits in pending[i] until
+     * the next 2^i are merged too. Every node thus takes part in O(log k)
+     * merges and the workspace stays bounded whatever the number of queues.
+     * A pending run always holds queues earlier in the chain than the run
+     * merged into it, so it goes first on ties and the merge stays stable.
+     */
+    list_t pending[32];
+    for (int i = 0; i < 32; i++) {
+        INIT_LIST_HEAD(&pending[i].list);
+        pending[i].size = 0;
     }
 
-    while (heap_size > 1) {
-        swap(heap + --heap_size, heap);
-        heapify(heap, heap_size, 0);
-        merge_tail_init(heap + heap_size, heap);
-        heapify(heap, heap_size, 0);
+    unsigned int runs = 0;
+    list_for_each_entry (ctx, head, chain) {
+        list_t run = {.size = q_size(ctx->q)};
+        if (!run.size)
+            continue;
+        INIT_LIST_HEAD(&run.list);
+        list_splice_init(ctx->q, &run.list);
+        q_header(ctx->q)->size = 0;
+
+        int order = 0;
+        for (; runs & (1U << order); order++) {
+            merge_runs(&run, &pending[order], descend);
+            move_run(&run, &pending[order]);
+        }
+        move_run(&pending[order], &run);
+        runs++;
     }
 
-    struct list_head *ret = container_of(head->next, queue_contex_t, chain)->q;
-    list_splice(&heap->list, ret);
-    if (descend)
-        q_reverse(ret);
+    list_t *merged = NULL;
+    for (int i = 0; i < 32; i++) {
+        if (!pending[i].size)
+            continue;
+        if (merged)
+            merge_runs(merged, &pending[i], descend);
+        merged = &pending[i];
+    }
+    if (merged) {
+        list_splice(&merged->list, ret);
+        q_header(ret)->size = merged->size;
+    }
     return q_size(ret);
-}
\ No newline at end of file
+}
@@ -9,22 +9,105 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "harness.h"
 #include "list.h"
 
+/* Strings shorter than this are stored inside the element itself */
+#define ELEMENT_INLINE_SIZE 24
+
 /**
  * element_t - Linked list element
- * @value: pointer to array holding string
  * @list: node of a doubly-linked list
- *
- * @value needs to be explicitly allocated and freed
+ * @prefix: first 8 bytes of the string packed in big-endian order, so that
+ *          comparing prefixes as integers agrees with strcmp()
+ * @is_inline: whether the string lives in @value.buf or behind @value.ptr
+ * @hash: hash of the string, only meaningful while the element is in the value
+ *        index of its queue, see q_find()
+ * @value: the string itself if it is short enough, a pointer to it otherwise
+ *
+ * Use element_value() to get at the string. The element, followed by the
+ * string of a long value, is carved out of the arena of the queue that created
+ * it as a single block and must be released with q_release_element().
  */
 typedef struct {
-    char *value;
     struct list_head list;
+    uint64_t prefix;
+    bool is_inline;
+    uint32_t hash;
+    union {
+        char *ptr;
+        char buf[ELEMENT_INLINE_SIZE];
+    } value;
 } element_t;
 
+/**
+ * element_value() - Get the string held by an element
+ * @e: element to look at
+ *
+ * Return: pointer to the null-terminated string of @e
+ */
+static inline char *element_value(element_t *e)
+{
+    return e->is_inline ? e->value.buf : e->value.ptr;
+}
+
+/**
+ * queue_t - Header of a queue
+ * @head: sentinel node of the circular doubly-linked list of elements
+ * @size: number of elements currently linked to @head
+ * @arena: slabs holding the elements and strings of this queue
+ * @mid: node at index ⌊@size / 2⌋, NULL when unknown or the queue is empty
+ * @index: positional index used by q_get(), q_delete_at() and q_split()
+ * @hash: value index used by q_find() and q_delete_value()
+ * @backend: storage layout of the queue, one of the QUEUE_* values
+ * @chunks: node arrays of an unrolled queue, see QUEUE_UNROLLED
+ * @ring: element array of a ring-buffer queue, see QUEUE_RING
+ *
+ * @head must stay in first position. Every operation below takes a pointer to
+ * @head and recovers the header with container_of(), so callers may keep
+ * treating a queue as a plain struct list_head while @size is maintained by
+ * each insertion, removal, deletion and merge.
+ *
+ * Insertions and removals at either end move @mid by at most one step, which
+ * keeps it valid. Operations that relink nodes arbitrarily, such as sorting or
+ * swapping, reset it to NULL and the next lookup walks half the list once.
+ * @index is built on the first positional access and kept across positional
+ * deletions, while any other change to the order of the nodes marks it stale
+ * so that the next positional access rebuilds it in place.
+ *
+ * @hash is built on the first lookup by value. Insertions, removals and
+ * single deletions then keep it up to date, reordering leaves it untouched
+ * since nodes never move in memory, and bulk deletions or merges mark it stale
+ * for the next lookup to rebuild.
+ */
+typedef struct {
+    struct list_head head;
+    int size;
+    test_arena_t *arena;
+    struct list_head *mid;
+    struct q_index *index;
+    struct q_hash *hash;
+    int backend;
+    struct {
+        struct list_head used;  /* Chunks holding the nodes, in order */
+        struct list_head spare; /* Empty chunks kept for reuse */
+        int nspare;
+        bool valid; /* Whether @used matches the order of the list */
+    } chunks;
+    struct {
+        element_t **slot;  /* Power-of-two array of element pointers */
+        unsigned int mask; /* Capacity minus one, 0 while @slot is NULL */
+        unsigned int head; /* Position of the first element, modulo 2^32 */
+        element_t **old;   /* Outgrown array, NULL once emptied */
+        unsigned int lo;   /* Positions [@lo, @hi) are still held by @old */
+        unsigned int hi;
+        bool active; /* Whether the elements live in @slot, unlinked */
+        void *parked; /* Rings of merged queues, linked through slot 0 */
+    } ring;
+} queue_t;
+
 /**
  * queue_contex_t - The context managing a chain of queues
  * @q: pointer to the head of the queue
@@ -39,11 +122,101 @@ typedef struct {
     int id;
 } queue_contex_t;
 
+/* Number of threads q_sort() and q_merge() may use on large inputs, 1 to run
+ * serially
+ */
+extern int q_threads;
+
+#define MERGE_MAX_LEVELS 32
+
+/**
+ * merge_stats_t - Timing of the last parallel q_merge()
+ * @levels: number of reduction levels, 0 if the merge ran serially
+ * @runs: number of non-empty queues entering each level
+ * @seconds: wall-clock time spent on each level
+ */
+typedef struct {
+    int levels;
+    int runs[MERGE_MAX_LEVELS];
+    double seconds[MERGE_MAX_LEVELS];
+} merge_stats_t;
+
+extern merge_stats_t q_merge_stats;
+
+/* Sort engines selectable through q_sort_algo */
+enum {
+    SORT_MERGE = 0, /* Adaptive merge sort, parallel on large queues */
+    SORT_RADIX = 1, /* MSD radix sort distributing nodes by byte */
+};
+
+/* Engine used by q_sort(), one of the SORT_* values */
+extern int q_sort_algo;
+
+/* Orderings selectable through q_compare */
+enum {
+    COMPARE_STRCMP = 0,  /* Byte order, as strcmp() */
+    COMPARE_NATURAL = 1, /* Runs of digits compare by their numeric value */
+    COMPARE_NOCASE = 2,  /* Byte order ignoring case, as strcasecmp() */
+    COMPARE_LENGTH = 3,  /* Shorter strings first, then byte order */
+    COMPARE_CUSTOM = 4,  /* q_compare_fn, or byte order while it is NULL */
+};
+
+/* Ordering used by q_sort(), q_merge(), q_ascend() and q_descend(), one of the
+ * COMPARE_* values. Each built-in ordering has its own copy of the sort and
+ * merge code with the comparison inlined; only COMPARE_CUSTOM makes an
+ * indirect call per comparison.
+ */
+extern int q_compare;
+
+/* Comparison of two strings used with COMPARE_CUSTOM, returning a value less
+ * than, equal to or greater than zero like strcmp()
+ */
+extern int (*q_compare_fn)(const char *a, const char *b);
+
+/**
+ * q_strcmp() - Compare two strings in the ordering selected by q_compare
+ * @a: first string
+ * @b: second string
+ *
+ * Return: less than, equal to or greater than zero as a sorts before, along
+ * with or after b.
+ */
+int q_strcmp(const char *a, const char *b);
+
+/* Storage layouts selectable through q_backend */
+enum {
+    QUEUE_LINKED = 0,   /* Plain doubly-linked list of elements */
+    QUEUE_UNROLLED = 1, /* Linked list of arrays of elements */
+    QUEUE_RING = 2,     /* Growable ring buffer of elements */
+};
+
+/* Layout given by q_new() to new queues, one of the QUEUE_* values */
+extern int q_backend;
+
 /* Operations on queue */
 
 /**
  * q_new() - Create an empty queue whose next and prev pointer point to itself
  *
+ * The returned pointer is the @head member of a freshly allocated queue_t.
+ *
+ * A queue created while q_backend is QUEUE_UNROLLED additionally keeps its
+ * elements, in order, in arrays of a few dozen entries, each entry caching the
+ * sort key prefix. Insertions and removals at either end stay O(1), while
+ * q_sort() and q_reverse() work on the arrays with sequential memory accesses
+ * and relink the list in one pass at the end. The elements stay linked as well,
+ * so every other operation and every caller walking the list behave the same.
+ * Operations without an array version mark the arrays stale, and the next
+ * insertion lays them out again.
+ *
+ * A queue created while q_backend is QUEUE_RING holds pointers to its elements
+ * in a power-of-two ring buffer and leaves their list nodes unlinked. A full
+ * ring moves to an array twice its size one element per insertion, so that no
+ * single insertion copies the whole ring. q_insert_*(), q_remove_*(), q_size(),
+ * q_get() and the q_peek_*() functions work on the ring directly. Any other
+ * operation first links the elements into the list, see q_link(), and the
+ * queue stays linked until an insertion finds it empty.
+ *
  * Return: NULL for allocation failed
  */
 struct list_head *q_new();
@@ -51,6 +224,12 @@ struct list_head *q_new();
 /**
  * q_free() - Free all storage used by queue, no effect if header is NULL
  * @head: header of queue
+ *
+ * The elements are released together with the arena of the queue, so the
+ * cost depends on the number of slabs rather than on the number of elements.
+ * Only when the arena is still shared with a queue split off by q_split() are
+ * the elements released one by one. Elements removed from the queue must be
+ * released before calling this.
  */
 void q_free(struct list_head *head);
 
@@ -78,6 +257,37 @@ bool q_insert_head(struct list_head *head, char *s);
  */
 bool q_insert_tail(struct list_head *head, char *s);
 
+/**
+ * q_insert_head_n() - Insert several elements in the head
+ * @head: header of queue
+ * @s: strings would be inserted
+ * @n: number of elements to insert
+ * @repeat: whether every element gets s[0] instead of s[0] to s[n - 1]
+ *
+ * Same as calling q_insert_head() on each string in turn, so s[n - 1] ends up
+ * first, but the new elements are chained apart and spliced in at once.
+ * Insertion stops at the first allocation failure, keeping the elements
+ * already made.
+ *
+ * Return: number of elements inserted, 0 if queue is NULL
+ */
+int q_insert_head_n(struct list_head *head, char **s, int n, bool repeat);
+
+/**
+ * q_insert_tail_n() - Insert several elements at the tail
+ * @head: header of queue
+ * @s: strings would be inserted
+ * @n: number of elements to insert
+ * @repeat: whether every element gets s[0] instead of s[0] to s[n - 1]
+ *
+ * Same as calling q_insert_tail() on each string in turn, but the new elements
+ * are chained apart and spliced in at once. Insertion stops at the first
+ * allocation failure, keeping the elements already made.
+ *
+ * Return: number of elements inserted, 0 if queue is NULL
+ */
+int q_insert_tail_n(struct list_head *head, char **s, int n, bool repeat);
+
 /**
  * q_remove_head() - Remove the element from head of queue
  * @head: header of queue
@@ -85,7 +295,8 @@ bool q_insert_tail(struct list_head *head, char *s);
  * @bufsize: size of the string
  *
  * If sp is non-NULL and an element is removed, copy the removed string to *sp
- * (up to a maximum of bufsize-1 characters, plus a null terminator.)
+ * (up to a maximum of bufsize-1 characters, plus a null terminator.) Only the
+ * string and its terminator are written, the rest of sp is left as is.
  *
  * NOTE: "remove" is different from "delete"
  * The space used by the list element and the string should not be freed.
@@ -108,6 +319,31 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize);
  */
 element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
 
+/**
+ * q_take_head() - Remove the element from head of queue without copying
+ * @head: header of queue
+ *
+ * The caller owns the returned element and reads its string in place with
+ * element_value(), then gives both back with q_release_element().
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+static inline element_t *q_take_head(struct list_head *head)
+{
+    return q_remove_head(head, NULL, 0);
+}
+
+/**
+ * q_take_tail() - Remove the element from tail of queue without copying
+ * @head: header of queue
+ *
+ * Return: the pointer to element, %NULL if queue is NULL or empty.
+ */
+static inline element_t *q_take_tail(struct list_head *head)
+{
+    return q_remove_tail(head, NULL, 0);
+}
+
 /**
  * q_release_element() - Release the element
  * @e: element would be released
@@ -116,14 +352,55 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
  */
 static inline void q_release_element(element_t *e)
 {
-    test_free(e->value);
-    test_free(e);
+    test_arena_free(e);
 }
 
+/**
+ * q_remove_head_n() - Remove and release several elements from head of queue
+ * @head: header of queue
+ * @n: maximum number of elements to remove
+ * @buf: packed output for the removed strings, or NULL to drop them
+ * @bufsize: size of @buf
+ * @offsets: where the i-th removed string starts in @buf, or NULL
+ *
+ * Removes up to n elements the way successive q_remove_head() calls would,
+ * copying each string with its null terminator right after the previous one
+ * in buf, then releases them all. Removal stops early at an element whose
+ * string does not fit in the rest of buf.
+ *
+ * Return: number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_head_n(struct list_head *head,
+                    int n,
+                    char *buf,
+                    size_t bufsize,
+                    size_t *offsets);
+
+/**
+ * q_remove_tail_n() - Remove and release several elements from tail of queue
+ * @head: header of queue
+ * @n: maximum number of elements to remove
+ * @buf: packed output for the removed strings, or NULL to drop them
+ * @bufsize: size of @buf
+ * @offsets: where the i-th removed string starts in @buf, or NULL
+ *
+ * Same as q_remove_head_n(), but from the tail, so the last element of queue
+ * is copied first.
+ *
+ * Return: number of elements removed, 0 if queue is NULL or empty.
+ */
+int q_remove_tail_n(struct list_head *head,
+                    int n,
+                    char *buf,
+                    size_t bufsize,
+                    size_t *offsets);
+
 /**
  * q_size() - Get the size of the queue
  * @head: header of queue
  *
+ * Runs in constant time by reading the element count cached in queue_t.
+ *
  * Return: the number of elements in queue, zero if queue is NULL or empty
  */
 int q_size(struct list_head *head);
@@ -136,6 +413,9 @@ int q_size(struct list_head *head);
  * ⌊n / 2⌋th node from the start using 0-based indexing.
  * If there're six elements, the third member should be returned.
  *
+ * Runs in constant time as long as the midpoint cursor of queue_t is valid,
+ * and the cursor stays valid across repeated deletions.
+ *
  * Reference:
  * https://leetcode.com/problems/delete-the-middle-node-of-a-linked-list/
  *
@@ -143,6 +423,86 @@ int q_size(struct list_head *head);
  */
 bool q_delete_mid(struct list_head *head);
 
+/**
+ * q_peek_mid() - Get the middle node in queue without removing it
+ * @head: header of queue
+ *
+ * The middle node is the same one q_delete_mid() would delete, thus the median
+ * (the upper one for an even size) when the queue is sorted. Like
+ * q_delete_mid(), this runs in constant time while the midpoint cursor of
+ * queue_t is valid.
+ *
+ * Return: the middle element, NULL if queue is NULL or empty.
+ */
+element_t *q_peek_mid(struct list_head *head);
+
+/**
+ * q_peek_head() - Get the first node in queue without removing it
+ * @head: header of queue
+ *
+ * Return: the first element, NULL if queue is NULL or empty.
+ */
+element_t *q_peek_head(struct list_head *head);
+
+/**
+ * q_peek_tail() - Get the last node in queue without removing it
+ * @head: header of queue
+ *
+ * Return: the last element, NULL if queue is NULL or empty.
+ */
+element_t *q_peek_tail(struct list_head *head);
+
+/**
+ * q_link() - Link every element of queue into its list
+ * @head: header of queue
+ *
+ * Callers walking the list of a queue directly must call this first, since a
+ * ring-buffer queue keeps its elements out of the list. No effect on other
+ * queues or if queue is NULL. Never allocates.
+ */
+void q_link(struct list_head *head);
+
+/**
+ * q_get() - Get the node at a given position in queue
+ * @head: header of queue
+ * @i: 0-based position of the node
+ *
+ * Positional access goes through an index of the nodes kept in queue_t, which
+ * answers in O(log n) time. The index is rebuilt in O(n) time on the first
+ * positional access after the queue was changed by any function other than
+ * q_delete_at() and q_split().
+ *
+ * Return: the element at position @i, NULL if queue is NULL, @i is out of
+ * range or the index could not be allocated.
+ */
+element_t *q_get(struct list_head *head, int i);
+
+/**
+ * q_delete_at() - Delete the node at a given position in queue
+ * @head: header of queue
+ * @i: 0-based position of the node
+ *
+ * Runs in O(log n) time through the same index as q_get().
+ *
+ * Return: true for success, false if queue is NULL, @i is out of range or the
+ * index could not be allocated.
+ */
+bool q_delete_at(struct list_head *head, int i);
+
+/**
+ * q_split() - Split queue in two at a given position
+ * @head: header of queue
+ * @i: number of nodes kept in queue, between 0 and its size
+ *
+ * The nodes from position @i on are moved, in order, to a new queue. They stay
+ * in the arena of @head, which both queues share from then on, so the split
+ * takes O(log n) time whatever the number of nodes moved.
+ *
+ * Return: the new queue, NULL if queue is NULL, @i is out of range or
+ * allocation failed.
+ */
+struct list_head *q_split(struct list_head *head, int i);
+
 /**
  * q_delete_dup() - Delete all nodes that have duplicate string,
  *                  leaving only distinct strings from the original queue.
@@ -155,6 +515,48 @@ bool q_delete_mid(struct list_head *head);
  */
 bool q_delete_dup(struct list_head *head);
 
+/**
+ * q_delete_dup_unsorted() - Delete all nodes that have duplicate string from a
+ *                           queue in any order
+ * @head: header of queue
+ *
+ * Same as q_delete_dup(), but duplicates need not be adjacent. Occurrences are
+ * counted in a hash table sized for the queue, so the cost is O(n) expected
+ * time, and the remaining nodes keep their original order.
+ *
+ * Return: true for success, false if list is NULL or the table cannot be
+ * allocated.
+ */
+bool q_delete_dup_unsorted(struct list_head *head);
+
+/**
+ * q_find() - Find a node of queue by its string
+ * @head: header of queue
+ * @s: string to look for
+ *
+ * Lookups go through a hash index of the values kept in queue_t, built in O(n)
+ * time on the first one and maintained afterwards, so each takes O(1)
+ * expected time.
+ *
+ * Return: an element whose string equals s, NULL if there is none, if queue
+ * is NULL or if the index could not be allocated.
+ */
+element_t *q_find(struct list_head *head, const char *s);
+
+/**
+ * q_delete_value() - Delete a node of queue by its string
+ * @head: header of queue
+ * @s: string of the node to delete
+ *
+ * Deletes and releases the element q_find() would return, in O(1) expected
+ * time. The middle node is then found again on demand, and a ring-buffer
+ * queue gets linked first, see q_link().
+ *
+ * Return: true if a node was deleted, false if there is none with string s,
+ * if queue is NULL or if the index could not be allocated.
+ */
+bool q_delete_value(struct list_head *head, const char *s);
+
 /**
  * q_swap() - Swap every two adjacent nodes
  * @head: header of queue
@@ -197,6 +599,16 @@ void q_reverseK(struct list_head *head, int k);
  *
  * No effect if queue is NULL or empty. If there has only one element, do
  * nothing.
+ *
+ * With SORT_MERGE, large queues are cut into q_threads runs that are sorted
+ * and then merged by concurrent threads. SORT_RADIX relinks the nodes into
+ * per-byte buckets and emits them directly in the requested order. Either
+ * way the sort is stable in both directions, needs no final reversal and
+ * never allocates list elements. An unrolled queue whose arrays are current is
+ * instead merge sorted array by array, whatever q_sort_algo says.
+ *
+ * Both of those other engines order bytes, so with any q_compare other than
+ * COMPARE_STRCMP the list merge sort runs instead.
  */
 void q_sort(struct list_head *head, bool descend);
 
@@ -238,10 +650,14 @@ int q_descend(struct list_head *head);
  *
  * This function merge the second to the last queues in the chain into the first
  * queue. The queues are guaranteed to be sorted before this function is called.
- * No effect if there is only one queue in the chain. Allocation is disallowed
- * in this function. There is no need to free the 'qcontext_t' and its member
- * 'q' since they will be released externally. However, q_merge() is responsible
- * for making the queues to be NULL-queue, except the first one.
+ * No effect if there is only one queue in the chain. Any number of queues can
+ * be merged, in O(N log k) time for N elements in k queues. With q_threads
+ * above 1, the merges of each level of the reduction tree run concurrently
+ * and their timing is recorded in q_merge_stats. Allocation is disallowed in
+ * this function. There is no need to free the 'qcontext_t' and
+ * its member 'q' since they will be released externally. However, q_merge() is
+ * responsible for making the queues to be NULL-queue, except the first one.
+ * Queues sharing an arena after q_split() must be in the same chain.
  *
  * Reference:
  * https://leetcode.com/problems/merge-k-sorted-lists/
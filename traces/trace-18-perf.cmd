@@ -0,0 +1,42 @@
+# Test performance of get mixed with insertions and removals at both ends
+option fail 0
+option malloc 0
+new
+it dolphin 500000
+ih gerbil 500000
+get 499999 gerbil
+get 500000 dolphin
+ih jaguar
+get 0 jaguar
+get 500000 gerbil
+get 500001 dolphin
+it koala
+get 1000001 koala
+rh jaguar
+get 0 gerbil
+rt koala
+get 999999 dolphin
+rh gerbil 1000
+get 498999 gerbil
+get 499000 dolphin
+ih lion 3
+get 2 lion
+get 3 gerbil
+rt dolphin 250000
+get 749002 dolphin
+get 499002 gerbil
+get 499003 dolphin
+it mouse 10
+get 749003 mouse
+get 749012 mouse
+get 749002 dolphin
+delete 3
+get 3 gerbil
+get 499001 gerbil
+get 499002 dolphin
+rh lion 3
+get 0 gerbil
+get 498998 gerbil
+get 498999 dolphin
+size
+free
@@ -0,0 +1,12 @@
+# Test realloc and aligned_alloc of the harness, with and without failures
+option fail 0
+option malloc 0
+alloc 2000
+new
+it dolphin 1000
+alloc 2000
+option malloc 25
+alloc 2000
+option malloc 0
+free
+alloc 100
@@ -0,0 +1,20 @@
+# Test sort, merge and the harness allocator with worker threads
+option fail 0
+option malloc 0
+option threads 4
+new
+it RAND 100000
+sort
+new
+ih RAND 100000
+sort
+new
+it RAND 50000
+sort
+merge
+size
+alloc 2000
+free
+option threads 8
+alloc 2000
+option threads 1
@@ -0,0 +1,39 @@
+# Test of get, delete, find, del, split, dedup unsorted, and rh/rt of n nodes
+option fail 0
+option malloc 0
+new
+it apple
+it banana
+it cherry
+it banana
+it date
+it apple
+it elder
+get 0 apple
+get 3 banana
+get 6 elder
+delete 2
+get 2 banana
+find date
+del date
+del elder
+find elder
+it fig
+ih grape
+dedup unsorted
+get 0 grape
+get 1 fig
+it kiwi 5
+it lemon 3
+ih mango 4
+split 6
+rh kiwi 5
+rt lemon 3
+size
+prev
+rh mango 4
+rt fig
+rh grape
+size
+free
+free
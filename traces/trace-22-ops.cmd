@@ -0,0 +1,41 @@
+# Test of operations on the unrolled and ring-buffer layouts
+option fail 0
+option malloc 0
+option backend 1
+new
+it b 40
+ih a 40
+it c 40
+get 39 a
+get 40 b
+get 80 c
+delete 40
+dm
+del c
+split 60
+rt c 39
+rh b 18
+prev
+sort
+rt b 20
+rh a 40
+size
+free
+free
+option backend 2
+new
+it b 40
+ih a 40
+get 40 b
+rt b 20
+rh a 40
+it c 20
+get 20 c
+rh b 20
+ih x
+get 0 x
+rh x
+rt c 20
+size
+free
+option backend 0
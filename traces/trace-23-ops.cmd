@@ -0,0 +1,80 @@
+# Test of sort orderings and engines, threads, poisoning and in-place removal
+option fail 0
+option malloc 0
+option poison 1
+option copy 0
+new
+it b10
+it a2
+it B1
+it a10
+option compare 1
+sort
+get 0 B1
+get 1 a2
+get 2 a10
+get 3 b10
+option compare 2
+sort
+get 0 a10
+get 1 a2
+get 2 B1
+get 3 b10
+option compare 3
+sort
+get 0 B1
+get 1 a2
+get 2 a10
+get 3 b10
+option compare 4
+sort
+get 0 B1
+get 1 a10
+get 2 a2
+get 3 b10
+option compare 0
+option sortalgo 1
+sort
+get 0 B1
+get 1 a10
+get 2 a2
+get 3 b10
+option descend 1
+sort
+get 0 b10
+get 1 a2
+get 2 a10
+get 3 B1
+option descend 0
+option sortalgo 0
+free
+option compare 2
+new
+it Apple
+new
+it apple
+it cherry
+new
+it Cherry
+merge
+prev
+prev
+get 0 Apple
+get 1 apple
+get 2 cherry
+get 3 Cherry
+free
+free
+free
+option compare 0
+option threads 4
+new
+it RAND 50000
+sort
+option sortalgo 1
+ih RAND 20000
+sort
+option sortalgo 0
+option threads 1
+option copy 1
+option poison 0
@@ -0,0 +1,45 @@
+# Test of malloc failure on get, delete, split, and dedup unsorted
+option fail 50
+option malloc 0
+new
+it apple
+it banana
+it apple
+it cherry
+option malloc 50
+dedup unsorted
+option malloc 0
+ih banana
+ih date
+option malloc 50
+dedup unsorted
+option malloc 0
+it date
+it fig
+option malloc 50
+dedup unsorted
+option malloc 0
+ih fig
+ih grape
+option malloc 50
+dedup unsorted
+option malloc 0
+dedup unsorted
+free
+new
+it kiwi 40
+option malloc 50
+get 5 kiwi
+get 30 kiwi
+delete 0
+delete 20
+get 10 kiwi
+split 30
+get 5 kiwi
+delete 2
+split 3
+get 1 kiwi
+option malloc 0
+free
+free
+free